@@ -35,7 +35,7 @@ vector<Symbol> SymbolExprAST::collectDefinedSymbols() {
 
 int SymbolExprAST::checkSymbols(Scope *scope) {
     if (!scope->contains(m_sym, m_type)) {
-        fprintf(stderr, "undefined reference to '%s'\n", syms.get(m_sym).c_str());
+        fprintf(stderr, "undefined reference to '%s'\n", syms.get(m_sym));
         return 1;
     }
     return 0;
@@ -281,27 +281,93 @@ UnaryExprAST::~UnaryExprAST() {
     delete m_arg;
 }
 
-sym_t SymbolTable::insert(string s) {
-    unsigned int i;
-    for (i = 0; i < m_symbols.size(); i++) {
-        if (s == m_symbols[i]) {
-            return i;
+#define SYMTAB_CHUNK (64 * 1024)
+#define SYMTAB_BUCKETS (1024)
+
+SymbolTable::SymbolTable() : m_buckets(SYMTAB_BUCKETS, -1), m_pos(NULL), m_free(0) {
+}
+
+SymbolTable::~SymbolTable() {
+    for (unsigned int i = 0; i < m_chunks.size(); i++) {
+        free(m_chunks[i]);
+    }
+}
+
+/* FNV-1a. */
+unsigned int SymbolTable::hash(const char *s, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Copies s into the current chunk and terminates it. Names longer than
+   a chunk get a chunk of their own. */
+const char *SymbolTable::store(const char *s, size_t len) {
+    if (len + 1 > m_free) {
+        size_t size = (len + 1 > SYMTAB_CHUNK) ? len + 1 : SYMTAB_CHUNK;
+        m_pos = (char *)malloc(size);
+        assert(m_pos != NULL);
+        m_chunks.push_back(m_pos);
+        m_free = size;
+    }
+    char *p = m_pos;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    m_pos += len + 1;
+    m_free -= len + 1;
+    return p;
+}
+
+/* Doubles the bucket array. Keeps the load factor at or below 1/2. */
+void SymbolTable::rehash() {
+    size_t mask = m_buckets.size() * 2 - 1;
+    vector<sym_t> buckets(mask + 1, -1);
+    for (unsigned int i = 0; i < m_symbols.size(); i++) {
+        size_t j = m_symbols[i].hash & mask;
+        while (buckets[j] != -1) {
+            j = (j + 1) & mask;
+        }
+        buckets[j] = i;
+    }
+    m_buckets.swap(buckets);
+}
+
+sym_t SymbolTable::insert(const char *s, size_t len) {
+    unsigned int h = hash(s, len);
+    size_t mask = m_buckets.size() - 1;
+    size_t j = h & mask;
+    while (m_buckets[j] != -1) {
+        const Entry &e = m_symbols[m_buckets[j]];
+        if (e.hash == h && e.len == len && memcmp(e.name, s, len) == 0) {
+            return m_buckets[j];
         }
+        j = (j + 1) & mask;
+    }
+
+    sym_t i = m_symbols.size();
+    Entry e = { store(s, len), len, h };
+    m_symbols.push_back(e);
+    m_buckets[j] = i;
+
+    if (m_symbols.size() * 2 > m_buckets.size()) {
+        rehash();
     }
-    m_symbols.push_back(s);
     return i;
 }
 
-string SymbolTable::get(sym_t i) const {
+const char *SymbolTable::get(sym_t i) const {
     assert(i < (int)m_symbols.size());
-    return m_symbols[i];
+    return m_symbols[i].name;
 }
 
 string SymbolTable::toString() const {
     stringstream s;
     s << "Symbol table contents:" << endl;
     for (unsigned int i = 0; i < m_symbols.size(); i++) {
-        s << i << ": " << m_symbols[i] << endl;
+        s << i << ": " << m_symbols[i].name << endl;
     }
     return s.str();
 }
@@ -314,7 +380,7 @@ void Scope::merge(const Scope *that) {
 void Scope::insert(Symbol s) {
     if (contains(s.sym)) {
         fprintf(stderr, "Redefinition of symbol '%s'\n",
-                syms.get(s.sym).c_str());
+                syms.get(s.sym));
         exit(ERR_SCOPE);
     }
     vector<sym_t> &v = (s.type == Var) ? m_vars : m_labels;
@@ -182,10 +182,33 @@ public:
     virtual int checkSymbols(Scope *scope) { return m_arg->checkSymbols(scope); }
 };
 
+/* Interns identifiers. Names are copied back to back into large chunks
+   which are never moved, so pointers returned by get() stay valid for the
+   lifetime of the table. Lookup goes through an open addressing hash table
+   of symbol indices. */
 class SymbolTable {
-    vector<string> m_symbols;
+    struct Entry {
+        const char *name;
+        size_t len;
+        unsigned int hash;
+    };
+    vector<Entry> m_symbols;
+    vector<sym_t> m_buckets;
+    vector<char *> m_chunks;
+    char *m_pos;
+    size_t m_free;
+
+    SymbolTable(const SymbolTable &);
+    SymbolTable &operator=(const SymbolTable &);
+
+    static unsigned int hash(const char *s, size_t len);
+    const char *store(const char *s, size_t len);
+    void rehash();
 public:
-    sym_t insert(string s);
-    string get(sym_t i) const;
+    SymbolTable();
+    ~SymbolTable();
+    sym_t insert(const char *s, size_t len);
+    const char *get(sym_t i) const;
+    size_t size() const { return m_symbols.size(); }
     string toString() const;
 };
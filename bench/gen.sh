@@ -0,0 +1,123 @@
+#!/bin/sh
+# Writes a generated benchmark program to stdout.
+#
+#   gen.sh nested DEPTH [undefined]
+#       One function with DEPTH nested ifs, each of which defines a
+#       variable and reads those of the outermost and the enclosing if.
+#       With undefined, the innermost if reads an undefined variable, so
+#       the compiler stops after checking. The parser stack limits DEPTH
+#       to about 2300.
+#   gen.sh funcs N
+#       N functions with arithmetic, a loop and calls, plus main(), which
+#       calls the last one.
+#   gen.sh lex MB
+#       A single function of about MB megabytes, whose last statement is a
+#       syntax error, so only scanning and parsing is done.
+#   gen.sh hot N
+#       N functions with a short loop, which calls sq() on every
+#       iteration, plus main(n), which calls all of them n times.
+
+usage() {
+    echo "usage: $0 nested DEPTH [undefined] | funcs N | lex MB | hot N" >&2
+    exit 1
+}
+
+[ $# -ge 2 ] || usage
+
+case $1 in
+nested)
+    awk -v depth="$2" -v undef="$3" 'BEGIN {
+        print "f(a)"
+        print "var v0 = a;"
+        for (i = 1; i <= depth; i++) {
+            printf "if v%d # 0 then\n", i - 1
+            printf "var v%d = (v%d + v0) + a;\n", i, i - 1
+        }
+        if (undef != "") {
+            printf "v%d = undefined;\n", depth
+        }
+        printf "return v%d;\n", depth
+        for (i = 1; i <= depth; i++) {
+            print "end;"
+        }
+        print "return 0;"
+        print "end;"
+    }'
+    ;;
+funcs)
+    awk -v n="$2" 'BEGIN {
+        for (i = 0; i < n; i++) {
+            printf "f%d(a, b)\n", i
+            print "    var x = (a and 7) + 1;"
+            printf "    var y = (b * 3) + %d;\n", i
+            print "  l: if x # 0 then"
+            print "        y = (y * 5) + (not x);"
+            print "        x = x + (-1);"
+            print "        goto l;"
+            print "    end;"
+            print "    if y =< 0 then"
+            print "        y = -y;"
+            print "    end;"
+            if (i % 10 == 0) {
+                print "    return y;"
+            } else {
+                printf "    return f%d(y, a) + x;\n", i - 1
+            }
+            print "end;"
+            print ""
+        }
+        print "main()"
+        printf "    return f%d(1, 2);\n", n - 1
+        print "end;"
+    }'
+    ;;
+lex)
+    awk -v mb="$2" 'BEGIN {
+        print "f(a)"
+        size = 0
+        for (i = 0; size < mb * 1048576; i++) {
+            line = sprintf("    var x%d = (a * %d) + (x%d and 4711);", i, i * 7, i)
+            print line
+            size += length(line) + 1
+        }
+        print "    var ;"
+        print "end;"
+    }'
+    ;;
+hot)
+    awk -v n="$2" 'BEGIN {
+        print "sq(x)"
+        print "    return x * x;"
+        print "end;"
+        print ""
+        for (i = 0; i < n; i++) {
+            printf "h%d(n)\n", i
+            print "    var acc = 0;"
+            print "  l: if n then"
+            printf "        acc = acc + (sq(n) + %d);\n", i
+            print "        n = n + (-1);"
+            print "        goto l;"
+            print "    end;"
+            print "    return acc;"
+            print "end;"
+            print ""
+        }
+        print "main(n)"
+        print "    var acc = 0;"
+        print "  l: if n then"
+        printf "        acc = acc + (h0(16)"
+        for (i = 1; i < n; i++) {
+            printf " + h%d(16)", i
+        }
+        print ");"
+        print "        n = n + (-1);"
+        print "        goto l;"
+        print "    end;"
+        print "    return acc;"
+        print "end;"
+    }'
+    ;;
+*)
+    usage
+    ;;
+esac
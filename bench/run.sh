@@ -0,0 +1,185 @@
+#!/bin/sh
+# Times the compiler on programs made by gen.sh and prints one table per
+# benchmark. Every time is the best of RUNS runs, in milliseconds.
+#
+#   CODEA       the compiler (default: gesamt/gesamt of this tree)
+#   CODEA_BASE  a build to compare against, e.g. of the baseline; scopes
+#               and lex time it too if set
+#   CLIENT      the compile server client (default: $CODEA-client)
+#   RUNS        runs per measurement (default: 5)
+#
+#   run.sh scopes        checking deeply nested scopes
+#   run.sh emit          one emitting thread against partitioned emission
+#   run.sh lex           scanner and parser throughput
+#   run.sh server        per-process compiles against the compile server
+#   run.sh interpret     --interpret, --run and --tiered, run once and hot
+#   run.sh object        assembly plus as against -c
+#   run.sh all           all of the above
+
+dir=$(cd "$(dirname "$0")" && pwd)
+CODEA=${CODEA:-$dir/../gesamt/gesamt}
+CLIENT=${CLIENT:-$CODEA-client}
+RUNS=${RUNS:-5}
+
+tmp=$(mktemp -d) || exit 1
+server=
+cleanup() {
+    [ -n "$server" ] && kill "$server" 2>/dev/null
+    rm -rf "$tmp"
+}
+trap cleanup EXIT INT TERM
+
+gen() {
+    sh "$dir/gen.sh" "$@"
+}
+
+# Prints the best wall time of RUNS runs of the shell command $1.
+best() {
+    min=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(date +%s%N)
+        eval "$1" >/dev/null 2>&1
+        end=$(date +%s%N)
+        t=$((end - start))
+        if [ -z "$min" ] || [ $t -lt "$min" ]; then
+            min=$t
+        fi
+        i=$((i + 1))
+    done
+    awk -v t="$min" 'BEGIN { printf "%.1f", t / 1e6 }'
+}
+
+ratio() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.2f", a / b }'
+}
+
+# Headings of the columns printed by base().
+basehead() {
+    [ -z "$CODEA_BASE" ] || printf " %10s %9s" base speedup
+}
+
+# With CODEA_BASE, prints its best time on the input $1 and the speedup
+# of the time $2 over it.
+base() {
+    if [ -n "$CODEA_BASE" ]; then
+        b=$(best "\"$CODEA_BASE\" < \"$1\"")
+        printf " %10s %9s" "$b" "$(ratio "$b" "$2")"
+    fi
+}
+
+# The innermost if reads an undefined variable, so only the front end
+# runs. Without layered scopes the check grows with the square of the
+# depth. The parser stack limits the depth to about 2300.
+bench_scopes() {
+    printf "%-8s %10s" depth ms
+    basehead
+    echo
+    for depth in 250 500 1000 2000; do
+        gen nested $depth undefined > "$tmp/in"
+        t=$(best "\"$CODEA\" < \"$tmp/in\"")
+        printf "%-8s %10s" $depth "$t"
+        base "$tmp/in" "$t"
+        echo
+    done
+}
+
+# Only emission runs on more threads; code generation stays on one, as
+# it would with -j.
+bench_emit() {
+    gen funcs 2000 > "$tmp/in"
+    base=$(best "\"$CODEA\" < \"$tmp/in\"")
+    printf "%-8s %10s %9s\n" threads ms speedup
+    printf "%-8s %10s %9s\n" 1 "$base" 1.00
+    for j in 2 4 8; do
+        t=$(best "\"$CODEA\" --emit-jobs=$j < \"$tmp/in\"")
+        printf "%-8s %10s %9s\n" $j "$t" "$(ratio "$base" "$t")"
+    done
+}
+
+# The program ends in a syntax error, so nothing is compiled.
+bench_lex() {
+    printf "%-8s %10s %8s" MB ms MB/s
+    basehead
+    echo
+    for mb in 4 16 64; do
+        gen lex $mb > "$tmp/in"
+        size=$(wc -c < "$tmp/in")
+        t=$(best "\"$CODEA\" < \"$tmp/in\"")
+        printf "%-8s %10s %8s" $mb "$t" "$(awk -v s="$size" -v t="$t" 'BEGIN { printf "%.1f", s / 1048576 / (t / 1000) }')"
+        base "$tmp/in" "$t"
+        echo
+    done
+}
+
+bench_server() {
+    gen funcs 10 > "$tmp/small"
+    gen funcs 1000 > "$tmp/large"
+    COMPILE_SERVER=$tmp/sock
+    export COMPILE_SERVER
+    "$CODEA" --server="$tmp/sock" 2>/dev/null &
+    server=$!
+    i=0
+    while [ ! -S "$tmp/sock" ] && [ $i -lt 100 ]; do
+        sleep 0.1
+        i=$((i + 1))
+    done
+    printf "%-8s %10s %10s %9s\n" input cold warm speedup
+    for f in small large; do
+        cold=$(best "\"$CODEA\" < \"$tmp/$f\"")
+        warm=$(best "\"$CLIENT\" < \"$tmp/$f\"")
+        printf "%-8s %10s %10s %9s\n" $f "$cold" "$warm" "$(ratio "$cold" "$warm")"
+    done
+    kill "$server"
+    server=
+}
+
+# Every function of gen.sh funcs runs once, so the first table is about
+# the time to the first result. In the second one, main() calls every
+# function of gen.sh hot n times; once that is well above the tiering
+# threshold, --tiered runs them as native code.
+bench_interpret() {
+    printf "%-8s %12s %10s %10s\n" funcs interpret run tiered
+    for n in 10 100 1000; do
+        gen funcs $n > "$tmp/in"
+        i=$(best "\"$CODEA\" --interpret=main < \"$tmp/in\"")
+        r=$(best "\"$CODEA\" --run=main < \"$tmp/in\"")
+        t=$(best "\"$CODEA\" --tiered=main < \"$tmp/in\"")
+        printf "%-8s %12s %10s %10s\n" $n "$i" "$r" "$t"
+    done
+    echo
+    gen hot 10 > "$tmp/in"
+    printf "%-8s %12s %10s %10s\n" n interpret run tiered
+    for n in 100 10000 100000; do
+        i=$(best "\"$CODEA\" --interpret=main,$n < \"$tmp/in\"")
+        r=$(best "\"$CODEA\" --run=main,$n < \"$tmp/in\"")
+        t=$(best "\"$CODEA\" --tiered=main,$n < \"$tmp/in\"")
+        printf "%-8s %12s %10s %10s\n" $n "$i" "$r" "$t"
+    done
+}
+
+bench_object() {
+    printf "%-8s %10s %10s %9s\n" funcs "asm+as" "-c" speedup
+    for n in 100 1000 4000; do
+        gen funcs $n > "$tmp/in"
+        a=$(best "\"$CODEA\" < \"$tmp/in\" > \"$tmp/out.s\" && as -o \"$tmp/out.o\" \"$tmp/out.s\"")
+        c=$(best "\"$CODEA\" -c < \"$tmp/in\" > \"$tmp/out.o\"")
+        printf "%-8s %10s %10s %9s\n" $n "$a" "$c" "$(ratio "$a" "$c")"
+    done
+}
+
+case $1 in
+scopes|emit|lex|server|interpret|object)
+    bench_$1
+    ;;
+all)
+    for b in scopes emit lex server interpret object; do
+        echo "== $b"
+        bench_$b
+    done
+    ;;
+*)
+    echo "usage: $0 scopes|emit|lex|server|interpret|object|all" >&2
+    exit 1
+    ;;
+esac
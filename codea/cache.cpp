@@ -0,0 +1,224 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "cache.hpp"
+
+using std::string;
+using std::vector;
+
+/* Suffix of complete entries; temporary files do not have it. */
+#define CACHE_SUFFIX ".bc"
+
+/* Temporary files this old were left behind by a crashed writer. */
+#define CACHE_STALE_TMP (60 * 60)
+
+/* Holds the size of all entries in decimal. Every process adds what it
+   has stored, under an exclusive lock. */
+#define CACHE_USAGE "usage"
+
+/* Eviction stops at this share of the limit, so it does not have to run
+   again right after the next store. */
+#define CACHE_LOW_WATER(limit) ((limit) / 10 * 9)
+
+FunctionCache::FunctionCache(const char *dir, unsigned long long limit)
+    : m_dir(dir), m_limit(limit), m_stored(0)
+{
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        perror(dir);
+    }
+}
+
+string FunctionCache::path(const string &key) const {
+    return m_dir + "/" + key + CACHE_SUFFIX;
+}
+
+/* An entry starts with the length of the text of its key in decimal, a
+   newline and the text itself. The data follows. */
+static string entryHeader(const string &text) {
+    char len[32];
+    snprintf(len, sizeof(len), "%lu\n", (unsigned long)text.size());
+    return len + text;
+}
+
+static int writeAll(int fd, const string &data) {
+    size_t n = 0;
+    while (n < data.size()) {
+        ssize_t k = write(fd, data.data() + n, data.size() - n);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return -1;
+        }
+        n += k;
+    }
+    return 0;
+}
+
+int FunctionCache::lookup(const string &key, const string &text, string &data) const {
+    string p = path(key);
+    int fd = open(p.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 0;
+    }
+    data.resize(st.st_size);
+    size_t n = 0;
+    while (n < data.size()) {
+        ssize_t k = read(fd, &data[n], data.size() - n);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            break;
+        }
+        n += k;
+    }
+    close(fd);
+
+    /* A different function whose key collides is a miss. */
+    string head = entryHeader(text);
+    if (n != data.size() || data.compare(0, head.size(), head) != 0) {
+        data.clear();
+        return 0;
+    }
+    data.erase(0, head.size());
+
+    /* Mark as recently used. */
+    utimes(p.c_str(), NULL);
+    return 1;
+}
+
+void FunctionCache::store(const string &key, const string &text,
+                          const string &data) const {
+    static unsigned int counter = 0;
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "/tmp.%d.%u", (int)getpid(),
+             __sync_fetch_and_add(&counter, 1));
+    string tmpPath = m_dir + tmp;
+
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) {
+        return;
+    }
+    string head = entryHeader(text);
+    int err = writeAll(fd, head) != 0 || writeAll(fd, data) != 0;
+    if (close(fd) != 0 || err ||
+            rename(tmpPath.c_str(), path(key).c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return;
+    }
+    /* Replacing an entry counts it twice, which only makes the next
+       listing of the directory come earlier. */
+    __sync_fetch_and_add(&m_stored, (unsigned long long)(head.size() + data.size()));
+}
+
+struct CacheEntry {
+    string path;
+    time_t mtime;
+    unsigned long long size;
+
+    bool operator<(const CacheEntry &o) const { return mtime < o.mtime; }
+};
+
+/* Lists the entries and removes the oldest ones if they are over the
+   limit. Returns the size of the entries left. */
+unsigned long long FunctionCache::shrink() const {
+    DIR *d = opendir(m_dir.c_str());
+    if (d == NULL) {
+        return 0;
+    }
+
+    vector<CacheEntry> entries;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        CacheEntry c;
+        c.path = m_dir + "/" + e->d_name;
+        struct stat st;
+        if (e->d_name[0] == '.' || stat(c.path.c_str(), &st) != 0) {
+            continue;
+        }
+
+        size_t len = strlen(e->d_name);
+        size_t slen = strlen(CACHE_SUFFIX);
+        if (len <= slen || strcmp(e->d_name + len - slen, CACHE_SUFFIX) != 0) {
+            if (strncmp(e->d_name, "tmp.", 4) == 0 && now - st.st_mtime > CACHE_STALE_TMP) {
+                unlink(c.path.c_str());
+            }
+            continue;
+        }
+        c.mtime = st.st_mtime;
+        c.size = st.st_size;
+        total += c.size;
+        entries.push_back(c);
+    }
+    closedir(d);
+
+    if (total <= m_limit) {
+        return total;
+    }
+
+    /* Entries removed by someone else in the meantime just count as gone. */
+    std::sort(entries.begin(), entries.end());
+    for (unsigned int i = 0; i < entries.size() && total > CACHE_LOW_WATER(m_limit); i++) {
+        unlink(entries[i].path.c_str());
+        total -= entries[i].size;
+    }
+    return total;
+}
+
+void FunctionCache::evict() const {
+    /* Hits do not change the size. */
+    unsigned long long stored = __sync_fetch_and_and(&m_stored, 0ULL);
+    if (stored == 0) {
+        return;
+    }
+
+    string usage = m_dir + "/" CACHE_USAGE;
+    int fd = open(usage.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        return;
+    }
+    /* Other processes wait until the new size has been written. */
+    while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {
+    }
+
+    /* Without a size, as in a new cache or after a crash while writing
+       it, the entries are listed. */
+    char buf[32];
+    ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+    unsigned long long total;
+    if (n > 0) {
+        buf[n] = '\0';
+        total = strtoull(buf, NULL, 10) + stored;
+    }
+    if (n <= 0 || total > m_limit) {
+        total = shrink();
+    }
+
+    n = snprintf(buf, sizeof(buf), "%llu\n", total);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, n, 0) != n) {
+        unlink(usage.c_str());
+    }
+    close(fd);
+}
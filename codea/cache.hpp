@@ -0,0 +1,36 @@
+#include <string>
+
+/* On-disk cache of compiled functions. Entries are files in a directory,
+   named after their key. They are written to a temporary file first and
+   renamed into place, so concurrent writers, even in different processes,
+   never expose partial entries. Hits refresh the modification time of an
+   entry; when the directory outgrows its limit, the least recently used
+   entries are removed. The size of the directory is kept in a file of its
+   own, so the entries only have to be listed once it is over the limit.
+
+   Keys are hashes. Each entry also holds the text its key was computed
+   from, and only counts as a hit if that text matches. */
+class FunctionCache {
+    std::string m_dir;
+    unsigned long long m_limit;
+    /* Bytes stored since the last call to evict(). */
+    mutable unsigned long long m_stored;
+
+    FunctionCache(const FunctionCache &);
+    FunctionCache &operator=(const FunctionCache &);
+
+    std::string path(const std::string &key) const;
+    unsigned long long shrink() const;
+public:
+    /* Creates dir if needed. limit is the size in bytes. */
+    FunctionCache(const char *dir, unsigned long long limit);
+
+    /* Returns nonzero and fills data if key is cached for text. */
+    int lookup(const std::string &key, const std::string &text, std::string &data) const;
+    void store(const std::string &key, const std::string &text,
+               const std::string &data) const;
+
+    /* Adds what has been stored to the size of the cache. If that is
+       over the limit, removes the oldest entries until it fits. */
+    void evict() const;
+};
@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "server.hpp"
+
+/* Drop-in replacement for the compiler which has a running compile
+   server do the work. Takes the same arguments. */
+int main(int argc, char **argv) {
+    const char *path = serverSocketPath();
+    if (path == NULL) {
+        return EXIT_FAILURE;
+    }
+    int code = requestCompile(path, argc, argv);
+    if (code < 0) {
+        fprintf(stderr, "%s: cannot reach compile server at %s\n", argv[0], path);
+        return EXIT_FAILURE;
+    }
+    return code;
+}
@@ -4,6 +4,11 @@
 #include <assert.h>
 #include <vector>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <sstream>
 #include <iostream>
 #include <llvm/DerivedTypes.h>
@@ -13,203 +18,968 @@
 #include <llvm/Analysis/Verifier.h>
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Support/FormattedStream.h>
 #include <llvm/Target/TargetData.h>
 #include <llvm/Target/TargetMachine.h>
 #include <llvm/Support/TargetRegistry.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Linker.h>
+#include <llvm/Instructions.h>
+#include <llvm/Constants.h>
+#include <llvm/Support/CFG.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/ExecutionEngine/JIT.h>
+#include <llvm/ExecutionEngine/GenericValue.h>
 
 #include "common.hpp"
+#include "cache.hpp"
+#include "interp.hpp"
 #include "gram.tab.hpp"
 
 #define INDENT (2)
 
-SymbolTable syms;
+__thread SymbolTable *syms = NULL;
+__thread Arena *astArena = NULL;
+__thread ExprPool *exprPool = NULL;
 
 using std::stringstream;
 using std::endl;
 using std::map;
+using std::set;
+
+int optLevel = OPT_LEVEL;
+
+/* State used during code generation. Every thread generating code
+   works on its own context and module; cg points to the one of the
+   current thread. */
+struct CodegenContext {
+    CodegenContext(LLVMContext &c, Module *m)
+        : context(c), module(m), builder(c), fpm(NULL), self(-1), params(NULL),
+          body(NULL) {}
+    ~CodegenContext() {
+        if (fpm != NULL) {
+            fpm->doFinalization();
+            delete fpm;
+        }
+    }
+    LLVMContext &context;
+    Module *module;
+    IRBuilder<> builder;
+
+    /* Function local optimizations, set up on first use. */
+    FunctionPassManager *fpm;
+
+    /* Labels, and variables which are kept in memory. */
+    map<int, Value *> namedValues;
+
+    /* State of the SSA construction for all other variables. */
+    set<sym_t> inMemory;
+    map<BasicBlock *, map<sym_t, Value *> > currentDef;
+    map<BasicBlock *, vector<std::pair<sym_t, PHINode *> > > incompletePhis;
+    set<BasicBlock *> sealed;
+    map<Value *, Value *> replaced;
+    vector<PHINode *> deadPhis;
+
+    /* The function being generated. Self recursive tail calls assign
+       its parameters and jump back to body. */
+    sym_t self;
+    const SymVector *params;
+    BasicBlock *body;
+
+    /* Scratch space of codegenExpr(). */
+    vector<Value *> values;
+    vector<std::pair<expr_t, expr_t> > calls;
+};
+
+static __thread CodegenContext *cg = NULL;
+
+#define TARGET_TRIPLE "x86_64-linux-gnu"
+
+/* Looks up the target machine description. The first call must happen
+   before any emitter thread is started. */
+static const Target *getTarget() {
+    static const Target *trg = NULL;
+    if (trg != NULL) {
+        return trg;
+    }
 
-/* Globals used during code generation. */
-Module *theModule = new Module("mainmodule", getGlobalContext());
-static IRBuilder<> builder(getGlobalContext());
-static map<int, Value *> namedValues;
-
-void printAsm() {
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
 
-    /* Create outstream. */
-    raw_fd_ostream rostr(fileno(stdout), false);
-    formatted_raw_ostream frostr(rostr);
-
-    /* Retrieve information about target machine. */
-    Triple trp("x86_64-linux-gnu");
-    theModule->setTargetTriple(trp.getTriple());
-
     string err;
-    const Target *trg = TargetRegistry::lookupTarget(trp.getTriple(), err);
+    trg = TargetRegistry::lookupTarget(TARGET_TRIPLE, err);
     if (trg == NULL) {
         std::cerr << err << endl;
         exit(ERR_SCOPE);
     }
+    return trg;
+}
+
+/* As last passed to initTarget(), for sourceKey(). */
+static int asmVerbosity = 1;
+
+void initTarget(int verboseAsm) {
+    getTarget();
+    TargetMachine::setAsmVerbosityDefault(verboseAsm);
+    asmVerbosity = verboseAsm;
+}
+
+static TargetMachine *createTargetMachine() {
+    return getTarget()->createTargetMachine(TARGET_TRIPLE, "", "");
+}
+
+/* The default -O1 keeps the code generator level used before there were
+   levels. */
+static CodeGenOpt::Level codegenOptLevel() {
+    switch (optLevel) {
+    case 0: return CodeGenOpt::None;
+    case 1:
+    case 2: return CodeGenOpt::Default;
+    default: return CodeGenOpt::Aggressive;
+    }
+}
+
+/* Adds the function local IR optimizations for optLevel to fpm. They
+   run on every function right after it has been generated, so their
+   result depends on nothing but the function itself. */
+static void addFunctionPasses(FunctionPassManager &fpm) {
+    switch (optLevel) {
+    case 0:
+        break;
+    case 1:
+        /* Promote first so the later passes see SSA values
+           instead of loads and stores. */
+        fpm.add(createPromoteMemoryToRegisterPass());
+        fpm.add(createBasicAliasAnalysisPass());
+        fpm.add(createInstructionCombiningPass());
+        fpm.add(createReassociatePass());
+        fpm.add(createGVNPass());
+        fpm.add(createCFGSimplificationPass());
+        break;
+    default: {
+        /* SROA, early CSE and friends. */
+        PassManagerBuilder pmb;
+        pmb.OptLevel = optLevel;
+        pmb.populateFunctionPassManager(fpm);
+        break;
+    }
+    }
+}
+
+/* Adds the IR optimizations for optLevel which work on the whole
+   module to pm. */
+static void addModulePasses(PassManager &pm) {
+    if (optLevel < 2) {
+        return;
+    }
+
+    /* Inliner, scalar and loop optimizations. */
+    PassManagerBuilder pmb;
+    pmb.OptLevel = optLevel;
+    pmb.Inliner = createFunctionInliningPass(optLevel > 2 ? 275 : 225);
+    pmb.populateModulePassManager(pm);
+}
+
+/* Optimizes the whole program m for --export. All functions but the
+   exported ones become internal, so calls to them can be inlined and
+   constants propagated into them, and unused ones are dropped. */
+static void optimizeWholeProgram(Module *m, const vector<string> &exports) {
+    vector<const char *> names;
+    for (unsigned int i = 0; i < exports.size(); i++) {
+        names.push_back(exports[i].c_str());
+    }
+
+    phaseBegin(PhaseOptimize);
+    {
+        PassManager pm;
+        pm.add(new TargetData(m));
+        pm.add(createInternalizePass(names));
+
+        /* IPSCCP, the inliner, global DCE and cleanups. */
+        PassManagerBuilder pmb;
+        pmb.OptLevel = optLevel;
+        pmb.populateLTOPassManager(pm, false, true);
+        pm.run(*m);
+    }
+    phaseEnd();
+}
+
+/* Optimizes m and writes assembly or an object file, as given by type,
+   for all functions defined in it. The module passes are left out after
+   optimizeWholeProgram(). */
+static void emitFile(Module *m, TargetMachine *tgm, formatted_raw_ostream &out,
+                     TargetMachine::CodeGenFileType type, bool wholeProgram) {
+    m->setTargetTriple(TARGET_TRIPLE);
+
+    /* Optimizations and code generation run in separate pass managers
+       so they can be timed on their own. */
+    if (!wholeProgram) {
+        phaseBegin(PhaseOptimize);
+        PassManager pm;
+        pm.add(new TargetData(m));
+        addModulePasses(pm);
+        pm.run(*m);
+        phaseEnd();
+    }
 
-    TargetMachine *tgm = trg->createTargetMachine(trp.getTriple(), "", "");
+    /* Add passes to print asm or write the object file. */
+    phaseBegin(PhaseEmit);
+    {
+        PassManager pm;
+        pm.add(new TargetData(m));
+        tgm->addPassesToEmitFile(pm, out, type, codegenOptLevel(), false);
+        pm.run(*m);
+    }
+    phaseEnd();
+}
 
-    /* Create and configure pass manager. */
-    PassManager pm;
-    pm.add(new TargetData(theModule));
+static bool isLabelChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '$';
+}
 
-    /* Override default to generate verbose assembly. */
-    tgm->setAsmVerbosityDefault(true);
+/* Local labels are numbered per run of the code generator, e.g. .LBB0_1
+   for a block of the first function emitted, so the output of separate
+   runs cannot simply be concatenated. They become .Lprefix.BB0_1, both
+   where they are defined and where they are used. Comments, which run
+   from '#' to the end of the line, and strings are left alone. */
+static void prefixLocalLabels(const string &in, const string &prefix, string &out) {
+    size_t last = 0;
+    bool comment = false, quoted = false;
+    for (size_t i = 0; i + 1 < in.size(); i++) {
+        char c = in[i];
+        if (c == '\n') {
+            comment = quoted = false;
+        } else if (comment) {
+            continue;
+        } else if (quoted) {
+            if (c == '\\') {
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == '#') {
+            comment = true;
+        } else if (c == '.' && in[i + 1] == 'L' && (i == 0 || !isLabelChar(in[i - 1]))) {
+            out.append(in, last, i + 2 - last);
+            out += prefix;
+            out += '.';
+            last = i + 2;
+        }
+    }
+    out.append(in, last, string::npos);
+}
 
-    /* Optimizations. */
-    pm.add(createBasicAliasAnalysisPass());
-    pm.add(createInstructionCombiningPass());
-    pm.add(createReassociatePass());
-    pm.add(createGVNPass());
-    pm.add(createCFGSimplificationPass());
-    pm.add(createPromoteMemoryToRegisterPass());
+struct AsmPartition {
+    const string *bitcode;
+    bool wholeProgram;
+    int index;
+    set<string> fns;
+    string out;
+};
+
+/* Emits the functions of one partition. The worker reads its own copy of
+   the module and strips the bodies of all functions it does not own.
+   Local labels are prefixed with the index of the partition.
+   Up to -O1 only function local passes are run, so every function is
+   compiled exactly as it would be in the whole module. From -O2 on,
+   calls into other partitions are not inlined. */
+static void *emitWorker(void *arg) {
+    AsmPartition *p = (AsmPartition *)arg;
+    LLVMContext context;
+
+    phaseBegin(PhaseEmit);
+    string err;
+    MemoryBuffer *buf = MemoryBuffer::getMemBuffer(*p->bitcode, "", false);
+    Module *m = ParseBitcodeFile(buf, context, &err);
+    delete buf;
+    if (m == NULL) {
+        fprintf(stderr, "%s\n", err.c_str());
+        exit(ERR_SCOPE);
+    }
 
-    /* Add pass to print asm. */
-    tgm->addPassesToEmitFile(pm, frostr, TargetMachine::CGFT_AssemblyFile,
-                            CodeGenOpt::Default, false);
+    /* Internal functions of other partitions become external
+       declarations. Calls to them still resolve, as all partitions
+       end up in the same assembly file. */
+    for (Module::iterator f = m->begin(); f != m->end(); ++f) {
+        if (!f->isDeclaration() && p->fns.count(f->getName().str()) == 0) {
+            f->deleteBody();
+            f->setLinkage(GlobalValue::ExternalLinkage);
+        }
+    }
 
-    /* Run passes. */
-    pm.run(*theModule);
+    TargetMachine *tgm = createTargetMachine();
+    string raw;
+    {
+        raw_string_ostream os(raw);
+        formatted_raw_ostream fos(os);
+        emitFile(m, tgm, fos, TargetMachine::CGFT_AssemblyFile, p->wholeProgram);
+    }
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "part%d", p->index);
+    prefixLocalLabels(raw, prefix, p->out);
 
     delete tgm;
+    delete m;
+    phaseEnd();
+    return NULL;
+}
+
+void printAsm(CompilerSession *s, int nthreads) {
+    getTarget();
+
+    Module *module = s->module;
+    raw_ostream &rostr = *s->asmOut;
+
+    bool wholeProgram = !s->opts.exports.empty();
+    if (wholeProgram) {
+        optimizeWholeProgram(module, s->opts.exports);
+    }
+
+    unsigned int size = 0;
+    unsigned int defined = 0;
+    for (Module::iterator f = module->begin(); f != module->end(); ++f) {
+        for (Function::iterator bb = f->begin(); bb != f->end(); ++bb) {
+            size += bb->size();
+        }
+        defined += !f->isDeclaration();
+    }
+
+    /* Object files cannot simply be concatenated like assembly, so they
+       are always written on one thread. */
+    if (nthreads <= 1 || defined < 2 || s->opts.object) {
+        TargetMachine *tgm = createTargetMachine();
+        {
+            formatted_raw_ostream frostr(rostr);
+            emitFile(module, tgm, frostr,
+                     s->opts.object ? TargetMachine::CGFT_ObjectFile
+                                    : TargetMachine::CGFT_AssemblyFile,
+                     wholeProgram);
+        }
+        delete tgm;
+        return;
+    }
+
+    /* Split the module into contiguous partitions of roughly the same
+       number of instructions. Concatenating their output in order keeps
+       the function order of the single threaded mode. */
+    string bitcode;
+    phaseBegin(PhaseEmit);
+    {
+        raw_string_ostream os(bitcode);
+        WriteBitcodeToFile(module, os);
+    }
+    phaseEnd();
+
+    if ((unsigned int)nthreads > defined) {
+        nthreads = defined;
+    }
+    vector<AsmPartition> parts(nthreads);
+    unsigned int part = 0, acc = 0;
+    for (Module::iterator f = module->begin(); f != module->end(); ++f) {
+        if (f->isDeclaration()) {
+            continue;
+        }
+        if (acc >= (size / nthreads) * (part + 1) && part + 1 < parts.size()) {
+            part++;
+        }
+        parts[part].fns.insert(f->getName().str());
+        for (Function::iterator bb = f->begin(); bb != f->end(); ++bb) {
+            acc += bb->size();
+        }
+    }
+
+    if (!llvm_is_multithreaded()) {
+        llvm_start_multithreaded();
+    }
+    vector<pthread_t> threads(parts.size());
+    for (unsigned int i = 0; i < parts.size(); i++) {
+        if (parts[i].fns.empty()) {
+            continue;
+        }
+        parts[i].bitcode = &bitcode;
+        parts[i].wholeProgram = wholeProgram;
+        parts[i].index = i;
+        if (pthread_create(&threads[i], NULL, emitWorker, &parts[i]) != 0) {
+            perror("pthread_create");
+            exit(ERR_SCOPE);
+        }
+    }
+    for (unsigned int i = 0; i < parts.size(); i++) {
+        if (parts[i].fns.empty()) {
+            continue;
+        }
+        pthread_join(threads[i], NULL);
+        rostr << parts[i].out;
+    }
+}
+
+/* The code generator is set up once and run on one function at a time.
+   Its printer writes the header of the file when it is initialized and
+   the end when it is finalized. */
+void streamAsm(CompilerSession *s) {
+    Module *m = s->module;
+    if (s->asmPasses == NULL) {
+        m->setTargetTriple(TARGET_TRIPLE);
+        if (s->target == NULL) {
+            s->target = createTargetMachine();
+        }
+        s->asmStream = new formatted_raw_ostream(*s->asmOut);
+        s->asmPasses = new FunctionPassManager(m);
+        s->asmPasses->add(new TargetData(m));
+        s->target->addPassesToEmitFile(*s->asmPasses, *s->asmStream,
+                                       TargetMachine::CGFT_AssemblyFile,
+                                       codegenOptLevel(), false);
+        s->asmPasses->doInitialization();
+    }
+
+    phaseBegin(PhaseOptimize);
+    {
+        PassManager pm;
+        pm.add(new TargetData(m));
+        addModulePasses(pm);
+        pm.run(*m);
+    }
+    phaseEnd();
+
+    phaseBegin(PhaseEmit);
+    for (Module::iterator f = m->begin(); f != m->end(); ++f) {
+        if (!f->isDeclaration()) {
+            s->asmPasses->run(*f);
+            f->deleteBody();
+        }
+    }
+    s->asmStream->flush();
+    phaseEnd();
+}
+
+void finishAsm(CompilerSession *s) {
+    if (s->asmPasses == NULL) {
+        return;
+    }
+    s->asmPasses->doFinalization();
+    delete s->asmPasses;
+    s->asmPasses = NULL;
+    delete s->asmStream;
+    s->asmStream = NULL;
+    s->asmOut->flush();
+}
+
+void emitFunctionAsm(CompilerSession *s, string &text) {
+    string name;
+    for (Module::iterator f = s->module->begin(); f != s->module->end(); ++f) {
+        if (!f->isDeclaration()) {
+            name = f->getName().str();
+            break;
+        }
+    }
+    if (name.empty()) {
+        return;
+    }
+
+    if (s->target == NULL) {
+        s->target = createTargetMachine();
+    }
+    string raw;
+    {
+        raw_string_ostream os(raw);
+        formatted_raw_ostream fos(os);
+        emitFile(s->module, s->target, fos, TargetMachine::CGFT_AssemblyFile, false);
+    }
+    prefixLocalLabels(raw, name, text);
+
+    for (Module::iterator f = s->module->begin(); f != s->module->end(); ++f) {
+        if (!f->isDeclaration()) {
+            f->deleteBody();
+        }
+    }
+}
+
+int runModule(CompilerSession *s) {
+    getTarget();
+
+    Function *f = s->module->getFunction(s->opts.run);
+    size_t nargs = s->opts.runArgs.size();
+    if (f == NULL || f->isDeclaration() || f->arg_size() != nargs) {
+        fprintf(stderr, "ERROR: no function %s with %lu parameters\n",
+                s->opts.run, (unsigned long)nargs);
+        return EXIT_FAILURE;
+    }
+
+    /* The code generator keeps passes on the module, and the engine
+       is going to own it. */
+    delete s->cg;
+    s->cg = NULL;
+    cg = NULL;
+
+    /* MCJIT cannot compile lazily yet, so the classic JIT is used.
+       Calls go through stubs which compile their target on first use. */
+    string err;
+    ExecutionEngine *ee = EngineBuilder(s->module)
+        .setEngineKind(EngineKind::JIT)
+        .setErrorStr(&err)
+        .setOptLevel(codegenOptLevel())
+        .create();
+    if (ee == NULL) {
+        std::cerr << err << endl;
+        exit(ERR_SCOPE);
+    }
+    s->module = NULL;
+    ee->DisableLazyCompilation(false);
+
+    vector<GenericValue> args(nargs);
+    for (size_t i = 0; i < nargs; i++) {
+        args[i].IntVal = APInt(64, s->opts.runArgs[i], true);
+    }
+    GenericValue ret = ee->runFunction(f, args);
+    fprintf(s->out, "%ld\n", (long)ret.IntVal.getSExtValue());
+
+    delete ee;
+    return 0;
+}
+
+int jitFunctions(CompilerSession *s, const vector<ExprAST *> &fns,
+                 const vector<std::pair<sym_t, void *> > &known, vector<void *> &addrs) {
+    phaseBegin(PhaseCodegen);
+    Module *m = new Module("tier", s->context);
+    vector<Function *> fs;
+    {
+        CodegenContext c(s->context, m);
+        cg = &c;
+        for (unsigned int i = 0; i < fns.size(); i++) {
+            Value *v = fns[i]->codegen();
+            if (v == 0) {
+                break;
+            }
+            fs.push_back(static_cast<Function *>(v));
+        }
+        cg = NULL;
+    }
+    phaseEnd();
+    if (fs.size() != fns.size()) {
+        delete m;
+        return 1;
+    }
+
+    phaseBegin(PhaseEmit);
+    if (s->jit == NULL) {
+        string err;
+        s->jit = EngineBuilder(m)
+            .setEngineKind(EngineKind::JIT)
+            .setErrorStr(&err)
+            .setOptLevel(codegenOptLevel())
+            .create();
+        if (s->jit == NULL) {
+            std::cerr << err << endl;
+            delete m;
+            phaseEnd();
+            return 1;
+        }
+    } else {
+        s->jit->addModule(m);
+    }
+    for (unsigned int i = 0; i < known.size(); i++) {
+        Function *f = m->getFunction(syms->get(known[i].first));
+        if (f != NULL) {
+            s->jit->addGlobalMapping(f, known[i].second);
+        }
+    }
+    /* Everything is compiled right here, off the interpreter's thread. */
+    s->jit->DisableLazyCompilation(true);
+    for (unsigned int i = 0; i < fs.size(); i++) {
+        addrs.push_back(s->jit->getPointerToFunction(fs[i]));
+    }
+    phaseEnd();
+    return 0;
 }
 
 static AllocaInst *createEntryBlockAlloca(Function *f, sym_t s) {
     IRBuilder<> b(&f->getEntryBlock(),f->getEntryBlock().begin());
-    return b.CreateAlloca(Type::getInt64Ty(getGlobalContext()), 0, syms.get(s).c_str());
+    return b.CreateAlloca(Type::getInt64Ty(cg->context), 0, syms->get(s));
 }
 
-static Function *create_or_get_fn(string name, int argc) {
-    Function *f = theModule->getFunction(name);
-    if (f == NULL) {
-        vector<Type *> ints(argc,
-                            Type::getInt64Ty(getGlobalContext()));
-        FunctionType *ft = FunctionType::get(Type::getInt64Ty(getGlobalContext()),
-                                             ints, false);
-        f = Function::Create(ft, Function::ExternalLinkage,
-                                       name, theModule);
+/* Variables which are not kept in memory are translated straight into
+   SSA form, following Braun et al., "Simple and Efficient Construction
+   of Static Single Assignment Form" (CC 2013). A block is sealed once
+   all of its predecessors are known; reads in unsealed blocks create
+   operandless phis which are completed on sealing. Label blocks can
+   be reached by gotos from anywhere, so they are only sealed at the
+   end of the function. */
+
+static Value *readVariable(sym_t v, BasicBlock *bb);
+
+static void writeVariable(sym_t v, BasicBlock *bb, Value *val) {
+    cg->currentDef[bb][v] = val;
+}
+
+/* Follows the chain of removed trivial phis. */
+static Value *resolve(Value *val) {
+    map<Value *, Value *>::iterator it;
+    while ((it = cg->replaced.find(val)) != cg->replaced.end()) {
+        val = it->second;
     }
-    return f;
+    return val;
 }
 
-Value *errorV(const char *str) { fprintf(stderr, "Error: %s\n", str); return 0; }
+static PHINode *newPhi(sym_t v, BasicBlock *bb) {
+    Type *t = Type::getInt64Ty(cg->context);
+    if (bb->empty()) {
+        return PHINode::Create(t, 0, syms->get(v), bb);
+    }
+    return PHINode::Create(t, 0, syms->get(v), &bb->front());
+}
 
-string NumberExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << "NUM: " << m_val << endl;
-    return s.str();
+static Value *tryRemoveTrivialPhi(PHINode *phi) {
+    Value *same = NULL;
+    for (unsigned int i = 0; i < phi->getNumIncomingValues(); i++) {
+        Value *op = phi->getIncomingValue(i);
+        if (op == same || op == phi) {
+            continue;
+        }
+        if (same != NULL) {
+            return phi;
+        }
+        same = op;
+    }
+    if (same == NULL) {
+        same = UndefValue::get(phi->getType());
+    }
+
+    vector<PHINode *> users;
+    for (Value::use_iterator u = phi->use_begin(); u != phi->use_end(); ++u) {
+        PHINode *p = dyn_cast<PHINode>(*u);
+        if (p != NULL && p != phi) {
+            users.push_back(p);
+        }
+    }
+
+    /* The phi may still be recorded as the current definition of its
+       variable, so it is only detached here and deleted at the end of
+       the function; replaced redirects lookups. */
+    phi->replaceAllUsesWith(same);
+    phi->dropAllReferences();
+    phi->removeFromParent();
+    cg->replaced[phi] = same;
+    cg->deadPhis.push_back(phi);
+
+    for (unsigned int i = 0; i < users.size(); i++) {
+        if (cg->replaced.count(users[i]) == 0) {
+            tryRemoveTrivialPhi(users[i]);
+        }
+    }
+    return same;
 }
 
-Value *NumberExprAST::codegen() {
-    /* 64 bits, signed */
-    return ConstantInt::get(getGlobalContext(), APInt(64, m_val, true));
+static Value *addPhiOperands(sym_t v, PHINode *phi) {
+    BasicBlock *bb = phi->getParent();
+    for (pred_iterator p = pred_begin(bb); p != pred_end(bb); ++p) {
+        phi->addIncoming(readVariable(v, *p), *p);
+    }
+    return tryRemoveTrivialPhi(phi);
 }
 
-string SymbolExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << "SYM: " << syms.get(m_sym) << endl;
-    return s.str();
+static Value *readVariableRecursive(sym_t v, BasicBlock *bb) {
+    Value *val;
+    if (cg->sealed.count(bb) == 0) {
+        PHINode *phi = newPhi(v, bb);
+        cg->incompletePhis[bb].push_back(std::make_pair(v, phi));
+        val = phi;
+    } else if (BasicBlock *pred = bb->getSinglePredecessor()) {
+        val = readVariable(v, pred);
+    } else if (pred_begin(bb) == pred_end(bb)) {
+        /* Unreachable, or read before the first assignment. */
+        val = UndefValue::get(Type::getInt64Ty(cg->context));
+    } else {
+        /* Break cycles with an operandless phi. */
+        PHINode *phi = newPhi(v, bb);
+        writeVariable(v, bb, phi);
+        val = addPhiOperands(v, phi);
+    }
+    writeVariable(v, bb, val);
+    return val;
 }
 
-vector<Symbol> SymbolExprAST::collectDefinedSymbols() {
-    vector<Symbol> v;
-    v.push_back(Symbol(m_sym, m_type));
-    return v;
+static Value *readVariable(sym_t v, BasicBlock *bb) {
+    map<BasicBlock *, map<sym_t, Value *> >::iterator b = cg->currentDef.find(bb);
+    if (b != cg->currentDef.end()) {
+        map<sym_t, Value *>::iterator d = b->second.find(v);
+        if (d != b->second.end()) {
+            return resolve(d->second);
+        }
+    }
+    return readVariableRecursive(v, bb);
 }
 
-int SymbolExprAST::checkSymbols(Scope *scope) {
-    if (!scope->contains(m_sym, m_type)) {
-        fprintf(stderr, "undefined reference to '%s'\n", syms.get(m_sym).c_str());
-        return 1;
+static void sealBlock(BasicBlock *bb) {
+    vector<std::pair<sym_t, PHINode *> > phis;
+    phis.swap(cg->incompletePhis[bb]);
+    cg->incompletePhis.erase(bb);
+    for (unsigned int i = 0; i < phis.size(); i++) {
+        addPhiOperands(phis[i].first, phis[i].second);
     }
-    return 0;
+    cg->sealed.insert(bb);
 }
 
-Value *SymbolExprAST::codegen() {
-    Value *v = namedValues[m_sym];
-    if (v == 0) {
-        return errorV("Unknown variable name");
+/* Clears all per function state. */
+static void resetFunctionState() {
+    for (unsigned int i = 0; i < cg->deadPhis.size(); i++) {
+        delete cg->deadPhis[i];
     }
-    return builder.CreateLoad(v, m_sym);
+    cg->deadPhis.clear();
+    cg->namedValues.clear();
+    cg->inMemory.clear();
+    cg->currentDef.clear();
+    cg->incompletePhis.clear();
+    cg->sealed.clear();
+    cg->replaced.clear();
+    cg->params = NULL;
+    cg->body = NULL;
 }
 
-string AddrExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << "SYMADDR: " << syms.get(m_sym) << endl;
-    return s.str();
+/* Runs the function local optimizations on f. */
+static void optimizeFunction(Function *f) {
+    if (optLevel == 0) {
+        return;
+    }
+    phaseBegin(PhaseOptimize);
+    if (cg->fpm == NULL) {
+        cg->fpm = new FunctionPassManager(cg->module);
+        cg->fpm->add(new TargetData(cg->module));
+        addFunctionPasses(*cg->fpm);
+        cg->fpm->doInitialization();
+    }
+    cg->fpm->run(*f);
+    phaseEnd();
 }
 
-vector<Symbol> AddrExprAST::collectDefinedSymbols() {
-    vector<Symbol> v;
-    v.push_back(Symbol(m_sym, m_type));
-    return v;
+/* Starts a block without predecessors after a return or goto. */
+static void startDummyBlock(Function *f) {
+    BasicBlock *dummyb = BasicBlock::Create(cg->context, "dummy", f);
+    cg->builder.SetInsertPoint(dummyb);
+    sealBlock(dummyb);
 }
 
-int AddrExprAST::checkSymbols(Scope *scope) {
-    if (!scope->contains(m_sym, m_type)) {
-        fprintf(stderr, "undefined reference to '%s'\n", syms.get(m_sym).c_str());
-        return 1;
+static Function *create_or_get_fn(const char *name, int argc) {
+    Function *f = cg->module->getFunction(name);
+    if (f == NULL) {
+        vector<Type *> ints(argc,
+                            Type::getInt64Ty(cg->context));
+        FunctionType *ft = FunctionType::get(Type::getInt64Ty(cg->context),
+                                             ints, false);
+        f = Function::Create(ft, Function::ExternalLinkage,
+                                       name, cg->module);
     }
-    return 0;
+    return f;
+}
+
+Value *errorV(const char *str) { fprintf(stderr, "Error: %s\n", str); return 0; }
+
+/* Stores val to the variable s, or records it as the current definition
+   if the variable is in SSA form. */
+static Value *assign(sym_t s, Value *val) {
+    if (cg->inMemory.count(s) == 0) {
+        writeVariable(s, cg->builder.GetInsertBlock(), val);
+        return val;
+    }
+    Value *v = cg->namedValues[s];
+    if (v == 0) {
+        return errorV("Unknown symbol");
+    }
+    return cg->builder.CreateStore(val, v);
 }
 
-Value *AddrExprAST::codegen() {
-    Value *v = namedValues[m_sym];
-    return (v != 0 ? v : errorV("Unknown symbol"));
+typedef std::pair<expr_t, expr_t> CallStart;
+
+/* Calls in the order they start in the source. Those starting at the same
+   entry are nested in each other, the outermost one comes first. */
+static bool callsBefore(const CallStart &x, const CallStart &y) {
+    return (x.first != y.first ? x.first < y.first : x.second > y.second);
 }
 
-FunctionExprAST::FunctionExprAST(sym_t name, SymList *pars, ExprList *stats)
-    : ExprAST(), m_name(name) {
-    if (pars) {
-        m_pars = pars->get();
-        delete pars;
+/* Generates the expression e of the current pool. Operands come before
+   the expressions using them, so a single pass over the range of e does,
+   keeping every value in cg->values until it is used. */
+static Value *codegenExpr(expr_t e) {
+    const ExprPool &p = *exprPool;
+    expr_t base = p.first(e);
+
+    /* Functions are kept in the order they are first mentioned in, which
+       for nested calls is the outer callee first. */
+    vector<CallStart> &calls = cg->calls;
+    calls.clear();
+    for (expr_t i = base; i <= e; i++) {
+        if (p.kind(i) == ExprCall) {
+            calls.push_back(CallStart(p.first(i), i));
+        }
     }
-    if (stats) {
-        m_stats = stats->get();
-        delete stats;
+    if (calls.size() > 1) {
+        std::sort(calls.begin(), calls.end(), callsBefore);
+        for (unsigned int i = 0; i < calls.size(); i++) {
+            create_or_get_fn(syms->get(p.sym(calls[i].second)), p.argCount(calls[i].second));
+        }
+    }
+
+    vector<Value *> &v = cg->values;
+    v.resize(e - base + 1);
+    for (expr_t i = base; i <= e; i++) {
+        Value *r;
+        switch (p.kind(i)) {
+        case ExprNumber:
+            /* 64 bits, signed */
+            r = ConstantInt::get(cg->context, APInt(64, p.value(i), true));
+            break;
+        case ExprSymbol:
+            if (cg->inMemory.count(p.sym(i)) == 0) {
+                r = readVariable(p.sym(i), cg->builder.GetInsertBlock());
+            } else if ((r = cg->namedValues[p.sym(i)]) == 0) {
+                r = errorV("Unknown variable name");
+            } else {
+                r = cg->builder.CreateLoad(r, p.sym(i));
+            }
+            break;
+        case ExprAddr:
+            r = cg->namedValues[p.sym(i)];
+            if (r == 0) {
+                r = errorV("Unknown symbol");
+            }
+            break;
+        case ExprUnary: {
+            Value *a = v[p.lhs(i) - base];
+            switch (p.op(i)) {
+            case NOT: r = cg->builder.CreateNot(a, "nottmp"); break;
+            case UNARYMINUS: r = cg->builder.CreateNeg(a, "negtmp"); break;
+            case DEREF:
+                a = cg->builder.CreateIntToPtr(a, Type::getInt64PtrTy(cg->context), "ptrtmp");
+                r = cg->builder.CreateLoad(a, "drftmp");
+                break;
+            default: r = errorV("Unknown unary operator."); break;
+            }
+            break;
+        }
+        case ExprBinary: {
+            Value *l = v[p.lhs(i) - base];
+            Value *rv = v[p.rhs(i) - base];
+            switch (p.op(i)) {
+            case '*': r = cg->builder.CreateMul(l, rv, "multmp"); break;
+            case '+': r = cg->builder.CreateAdd(l, rv, "addtmp"); break;
+            case AND: r = cg->builder.CreateAnd(l, rv, "andtmp"); break;
+            case OPLESSEQ:
+                l = cg->builder.CreateICmpSLE(l, rv, "cmptmp");
+                r = cg->builder.CreateZExt(l, Type::getInt64Ty(cg->context), "csttmp");
+                break;
+            case '#':
+                l = cg->builder.CreateICmpNE(l, rv);
+                r = cg->builder.CreateZExt(l, Type::getInt64Ty(cg->context), "csttmp");
+                break;
+            default: r = errorV("Unknown binary operator."); break;
+            }
+            break;
+        }
+        case ExprCall: {
+            unsigned int n = p.argCount(i);
+            Function *f = create_or_get_fn(syms->get(p.sym(i)), n);
+            if (f->arg_size() != n) {
+                fprintf(stderr, "Incorrect number of args passed to %s.\n", syms->get(p.sym(i)));
+            }
+            vector<Value *> argsv;
+            for (unsigned int k = 0; k < n; k++) {
+                argsv.push_back(v[p.arg(i, k) - base]);
+            }
+            r = cg->builder.CreateCall(f, argsv, "calltmp");
+            break;
+        }
+        default:
+            /* Dropped by fold(). */
+            continue;
+        }
+        if (r == 0) {
+            return 0;
+        }
+        v[i - base] = r;
     }
+    return v[e - base];
 }
 
-string FunctionExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << "FUN: " << syms.get(m_name);
-    if (m_scope != NULL) {
-        s << "; " << m_scope->toString();
-    } else {
-        s << endl;
+/* Generates the call e as the value of a return statement, including the
+   return. A call of the current function becomes a jump back to its
+   start. */
+static Value *codegenTail(expr_t e) {
+    const ExprPool &p = *exprPool;
+    Function *f = cg->builder.GetInsertBlock()->getParent();
+
+    if (p.sym(e) == cg->self && p.argCount(e) == cg->params->size()) {
+        /* All arguments are computed before any parameter changes. */
+        vector<Value *> argsv;
+        for (unsigned int i = 0; i < p.argCount(e); i++) {
+            argsv.push_back(codegenExpr(p.arg(e, i)));
+            if (argsv.back() == 0) {
+                return 0;
+            }
+        }
+        BasicBlock *bb = cg->builder.GetInsertBlock();
+        for (unsigned int i = 0; i < argsv.size(); i++) {
+            writeVariable((*cg->params)[i], bb, argsv[i]);
+        }
+        Value *v = cg->builder.CreateBr(cg->body);
+        startDummyBlock(f);
+        return v;
     }
-    s << "PARS:" << endl;
-    for (unsigned int i = 0; i < m_pars.size(); i++) {
-        s << syms.get(m_pars[i]);
+
+    Value *v = codegenExpr(e);
+    if (v == 0) {
+        return 0;
     }
-    s << "STATS:" << endl;
-    for (unsigned int i = 0; i < m_stats.size(); i++) {
-        s << m_stats[i]->toString(level + 1);
+    static_cast<CallInst *>(v)->setTailCall();
+    v = cg->builder.CreateRet(v);
+    startDummyBlock(f);
+    return v;
+}
+
+FunctionExprAST::FunctionExprAST(sym_t name, SymList *pars, ExprList *stats, ExprPool *exprs,
+                                 int line)
+    : ExprAST(), m_name(name), m_exprs(exprs), m_line(line), m_scope(NULL) {
+    if (pars) {
+        pars->take(m_pars);
+    }
+    if (stats) {
+        stats->take(m_stats);
     }
-    return s.str();
 }
 
-FunctionExprAST::~FunctionExprAST() {
+void FunctionExprAST::dump(AstDumper &d) const {
+    UsePool use(m_exprs);
+    d.begin("FUN");
+    d.attr(syms->get(m_name));
+    d.begin("PARS");
+    for (unsigned int i = 0; i < m_pars.size(); i++) {
+        d.attr(syms->get(m_pars[i]));
+    }
+    d.end();
     for (unsigned int i = 0; i < m_stats.size(); i++) {
-        delete m_stats[i];
+        m_stats[i]->dump(d);
     }
-    delete m_scope;
+    d.end();
 }
 
 vector<Symbol> FunctionExprAST::collectDefinedSymbols() {
-    m_scope = new Scope;
-    m_scope->insertAll(m_pars, Var);
+    UsePool use(m_exprs);
+    /* Nested scopes are built while collecting, so our own scope
+       can only be filled once all statements are done. */
+    vector<Symbol> v;
     for (unsigned int i = 0; i < m_stats.size(); i++) {
-        m_scope->insertAll(m_stats[i]->collectDefinedSymbols());
+        vector<Symbol> ssyms = m_stats[i]->collectDefinedSymbols();
+        v.insert(v.end(), ssyms.begin(), ssyms.end());
     }
+    m_scope = new Scope;
+    m_scope->insertAll(m_pars, Var, m_line);
+    m_scope->insertAll(v);
     return vector<Symbol>();
 }
 
@@ -217,215 +987,434 @@ int FunctionExprAST::checkSymbols(Scope * /* scope UNUSED */) {
     assert(scope == NULL);
     assert(m_scope != NULL);
 
+    UsePool use(m_exprs);
     int j = 0;
+    m_scope->enter();
     for (unsigned int i = 0; i < m_stats.size(); i++) {
         j += m_stats[i]->checkSymbols(m_scope);
     }
+    m_scope->leave();
 
     return j;
 }
 
+void FunctionExprAST::collectAddressTaken(set<sym_t> &vars) const {
+    UsePool use(m_exprs);
+    for (unsigned int i = 0; i < m_stats.size(); i++) {
+        m_stats[i]->collectAddressTaken(vars);
+    }
+}
+
 Value *FunctionExprAST::codegen() {
-    namedValues.clear();
+    UsePool use(m_exprs);
+    resetFunctionState();
+    collectAddressTaken(cg->inMemory);
 
-    Function *f = create_or_get_fn(syms.get(m_name), m_pars.size());
+    Function *f = create_or_get_fn(syms->get(m_name), m_pars.size());
 
-    BasicBlock *bb = BasicBlock::Create(getGlobalContext(), "entry", f);
-    builder.SetInsertPoint(bb);
+    BasicBlock *bb = BasicBlock::Create(cg->context, "entry", f);
+    cg->builder.SetInsertPoint(bb);
+    sealBlock(bb);
 
     /* Create a block for each label and store them in namedValues. */
-    const vector<sym_t> labels = m_scope->labels();
+    const SymVector &labels = m_scope->labels();
     for (unsigned int i = 0; i < labels.size(); i++) {
-        BasicBlock *blk = BasicBlock::Create(getGlobalContext(), syms.get(labels[i]));
-        namedValues[labels[i]] = blk;
+        BasicBlock *blk = BasicBlock::Create(cg->context, syms->get(labels[i]));
+        cg->namedValues[labels[i]] = blk;
     }
 
-    /* Create all local vars on the stack and store them in namedValues. */
-    const vector<sym_t> variables = m_scope->variables();
+    /* Create local vars which have their address taken on the stack
+       and store them in namedValues. */
+    const SymVector &variables = m_scope->variables();
     for (unsigned int i = 0; i < variables.size(); i++) {
-        AllocaInst *alloca = createEntryBlockAlloca(f, variables[i]);
-        namedValues[variables[i]] = alloca;
+        if (cg->inMemory.count(variables[i]) != 0) {
+            AllocaInst *alloca = createEntryBlockAlloca(f, variables[i]);
+            cg->namedValues[variables[i]] = alloca;
+        }
     }
 
     /* Name args and store their values. */
     unsigned int i = 0;
     for (Function::arg_iterator ai = f->arg_begin(); i != m_pars.size();
          ++ai, ++i) {
-        ai->setName(syms.get(m_pars[i]));
-        builder.CreateStore(ai, namedValues[m_pars[i]]);
+        ai->setName(syms->get(m_pars[i]));
+        if (cg->inMemory.count(m_pars[i]) != 0) {
+            cg->builder.CreateStore(ai, cg->namedValues[m_pars[i]]);
+        } else {
+            writeVariable(m_pars[i], bb, ai);
+        }
     }
 
+    /* Self recursive tail calls jump back to the start of the body, which
+       is sealed like a label once all of them have been seen. Without
+       them, the optimizer merges it back into the entry block. */
+    cg->self = m_name;
+    cg->params = &m_pars;
+    cg->body = BasicBlock::Create(cg->context, "body", f);
+    cg->builder.CreateBr(cg->body);
+    cg->builder.SetInsertPoint(cg->body);
+
     for (unsigned int i = 0; i < m_stats.size(); i++) {
         Value *retVal = m_stats[i]->codegen();
         if (retVal == 0) {
             f->eraseFromParent();
+            resetFunctionState();
             return 0;
         }
     }
 
+    /* All gotos have been seen, so label blocks can be sealed now. */
+    for (unsigned int i = 0; i < labels.size(); i++) {
+        sealBlock(static_cast<BasicBlock *>(cg->namedValues[labels[i]]));
+    }
+    sealBlock(cg->body);
+
     /* Add a dummy return value.
        If we pass real return statement, we execute it and start a new (unreachable)
        dummy block to avoid having to play around with block terminators. If that has
        happened, the following ret is unreachable and will be optimized out.
        If we haven't passed a return statement, default to returning 0. */
-    builder.CreateRet(ConstantInt::get(getGlobalContext(), APInt(64, 0, true)));
+    cg->builder.CreateRet(ConstantInt::get(cg->context, APInt(64, 0, true)));
 
+    resetFunctionState();
     verifyFunction(*f);
+    countIR(f);
+    optimizeFunction(f);
 
     return f;
 }
 
-string StatementExprAST::toString(int level) const {
-    stringstream s;
-    for (unsigned int i = 0; i < m_labels.size(); i++) {
-        s << syms.get(m_labels[i]);
-    }
-    s << m_stat->toString(level);
-    return s.str();
+StatementExprAST::StatementExprAST(SymList *labels, ExprAST *stat, int line)
+    : ExprAST(), m_stat(stat), m_line(line)
+{
+    labels->take(m_labels);
 }
 
-StatementExprAST::~StatementExprAST() {
-    delete m_stat;
+void StatementExprAST::dump(AstDumper &d) const {
+    if (m_labels.empty()) {
+        m_stat->dump(d);
+        return;
+    }
+    d.begin("LABELS");
+    for (unsigned int i = 0; i < m_labels.size(); i++) {
+        d.attr(syms->get(m_labels[i]));
+    }
+    m_stat->dump(d);
+    d.end();
 }
 
 vector<Symbol> StatementExprAST::collectDefinedSymbols() {
     vector<Symbol> v = m_stat->collectDefinedSymbols();
     for (unsigned int i = 0; i < m_labels.size(); i++) {
-        v.push_back(Symbol(m_labels[i], Label));
+        v.push_back(Symbol(m_labels[i], Label, m_line));
     }
     return v;
 }
 
+void StatementExprAST::collectAddressTaken(set<sym_t> &vars) const {
+    m_stat->collectAddressTaken(vars);
+}
+
 Value *StatementExprAST::codegen() {
-    Function *f = builder.GetInsertBlock()->getParent();
+    Function *f = cg->builder.GetInsertBlock()->getParent();
 
     /* A label translates to a block, which may be empty (except
        for branching to the next block). */
     for (unsigned int i = 0; i < m_labels.size(); i++) {
-        BasicBlock *blk = dynamic_cast<BasicBlock *>(namedValues[m_labels[i]]);
+        BasicBlock *blk = dynamic_cast<BasicBlock *>(cg->namedValues[m_labels[i]]);
         assert(blk != NULL);
 
-        builder.CreateBr(blk);
+        cg->builder.CreateBr(blk);
 
         f->getBasicBlockList().push_back(blk);
-        builder.SetInsertPoint(blk);
+        cg->builder.SetInsertPoint(blk);
     }
     return m_stat->codegen();
 }
 
-CallExprAST::CallExprAST(sym_t callee, ExprList *args)
-    : ExprAST(), m_callee(callee)
-{
-    if (args != NULL) {
-        m_args = args->get();        
-        delete args;
+static const char *opstr(int op) {
+    switch (op) {
+    case DEREF: return "DEREF";
+    case UNARYMINUS: return "UNARYMINUS";
+    case RETURN: return "RETURN";
+    case OPLESSEQ: return "OPLESSEQ";
+    case GOTO: return "GOTO";
+    case IF: return "IF";
+    case NOT: return "NOT";
+    case AND: return "AND";
+    case VAR: return "VAR";
+    case '=': return "=";
+    case '*': return "*";
+    case '-': return "-";
+    case '+': return "+";
+    case '#': return "#";
+    default: return "???";
     }
 }
 
-string CallExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << "CALL: " << syms.get(m_callee) << endl;
-    for (unsigned int i = 0; i < m_args.size(); i++) {
-        s << m_args[i]->toString(level + 1);
+expr_t ExprPool::add(enum ExprKind kind, int op, expr_t a, expr_t b) {
+    astNodes++;
+    m_kind.push_back(kind);
+    m_op.push_back(op);
+    m_a.push_back(a);
+    m_b.push_back(b);
+    return m_kind.size() - 1;
+}
+
+expr_t ExprPool::number(long val) {
+    m_consts.push_back(val);
+    return add(ExprNumber, 0, m_consts.size() - 1, EXPR_NONE);
+}
+
+expr_t ExprPool::symbol(sym_t s, int line) {
+    return add(ExprSymbol, Var, s, line);
+}
+
+expr_t ExprPool::addr(sym_t s, enum SymType t, int line) {
+    return add(ExprAddr, t, s, line);
+}
+
+expr_t ExprPool::unary(op_t op, expr_t arg) {
+    return add(ExprUnary, op, arg, EXPR_NONE);
+}
+
+expr_t ExprPool::binary(op_t op, expr_t lhs, expr_t rhs) {
+    return add(ExprBinary, op, lhs, rhs);
+}
+
+expr_t ExprPool::call(sym_t callee, ArgList *args) {
+    ArgList::Vector v;
+    if (args != NULL) {
+        args->take(v);
+    }
+    expr_t list = m_args.size();
+    m_args.push_back(v.size());
+    m_args.insert(m_args.end(), v.begin(), v.end());
+    return add(ExprCall, 0, callee, list);
+}
+
+expr_t ExprPool::first(expr_t e) const {
+    for (;;) {
+        switch (m_kind[e]) {
+        case ExprUnary:
+        case ExprBinary:
+            e = m_a[e];
+            break;
+        case ExprCall:
+            if (argCount(e) == 0) {
+                return e;
+            }
+            e = arg(e, 0);
+            break;
+        default:
+            return e;
+        }
     }
-    return s.str();
 }
 
-CallExprAST::~CallExprAST() {
-    for (unsigned int i = 0; i < m_args.size(); i++) {
-        delete m_args[i];
+bool ExprPool::constantValue(expr_t e, long &val) const {
+    if (m_kind[e] != ExprNumber) {
+        return false;
     }
+    val = value(e);
+    return true;
 }
 
-int CallExprAST::checkSymbols(Scope *scope) {
+void ExprPool::dump(expr_t e, AstDumper &d) const {
+    switch (m_kind[e]) {
+    case ExprNumber:
+        d.begin("NUM");
+        d.attr(value(e));
+        break;
+    case ExprSymbol:
+        d.begin("SYM");
+        d.attr(syms->get(sym(e)));
+        break;
+    case ExprAddr:
+        d.begin("SYMADDR");
+        d.attr(syms->get(sym(e)));
+        break;
+    case ExprUnary:
+        d.begin(opstr(m_op[e]));
+        dump(m_a[e], d);
+        break;
+    case ExprBinary:
+        d.begin(opstr(m_op[e]));
+        dump(m_a[e], d);
+        dump(m_b[e], d);
+        break;
+    case ExprCall:
+        d.begin("CALL");
+        d.attr(syms->get(sym(e)));
+        for (unsigned int i = 0; i < argCount(e); i++) {
+            dump(arg(e, i), d);
+        }
+        break;
+    default:
+        assert(0);
+        return;
+    }
+    d.end();
+}
+
+int ExprPool::checkSymbols(expr_t e, Scope *scope) const {
     int j = 0;
-    for (unsigned int i = 0; i < m_args.size(); i++) {
-        j += m_args[i]->checkSymbols(scope);
+    for (expr_t i = first(e); i <= e; i++) {
+        if (m_kind[i] != ExprSymbol && m_kind[i] != ExprAddr) {
+            continue;
+        }
+        if (!scope->contains(sym(i), type(i))) {
+            diags->error(ERR_SCOPE, line(i), "undefined reference to '%s'", syms->get(sym(i)));
+            j++;
+        }
     }
     return j;
 }
 
-Value *CallExprAST::codegen() {
-    Function *f = create_or_get_fn(syms.get(m_callee), m_args.size());
-    if (f->arg_size() != m_args.size()) {
-        fprintf(stderr, "Incorrect number of args passed to %s.\n", syms.get(m_callee).c_str());
+void ExprPool::collectAddressTaken(expr_t e, set<sym_t> &vars) const {
+    for (expr_t i = first(e); i <= e; i++) {
+        if (m_kind[i] == ExprAddr && type(i) == Var) {
+            vars.insert(sym(i));
+        }
     }
+}
 
-    vector<Value *> argsv;
-    for (unsigned int i = 0; i < m_args.size(); i++) {
-        argsv.push_back(m_args[i]->codegen());
-        if (argsv.back() == 0) {
-            return 0;
-        }
+void SimpleExprAST::dump(AstDumper &d) const {
+    if (m_op == 0) {
+        exprPool->dump(m_lhs, d);
+        return;
+    }
+    d.begin(opstr(m_op));
+    exprPool->dump(m_lhs, d);
+    if (m_rhs != EXPR_NONE) {
+        exprPool->dump(m_rhs, d);
     }
+    d.end();
+}
 
-    return builder.CreateCall(f, argsv, "calltmp");
+vector<Symbol> SimpleExprAST::collectDefinedSymbols() {
+    /* A symbol on its own is defined by the statement, as it has always
+       been, even without VAR. */
+    vector<Symbol> v;
+    const ExprPool &p = *exprPool;
+    enum ExprKind k = p.kind(m_lhs);
+    if ((m_op == VAR || m_op == 0) && (k == ExprSymbol || k == ExprAddr)) {
+        v.push_back(Symbol(p.sym(m_lhs), p.type(m_lhs), p.line(m_lhs)));
+    }
+    return v;
 }
 
-static const char *opstr(int op) {
-    switch (op) {
-    case DEREF: return "DEREF";
-    case UNARYMINUS: return "UNARYMINUS";
-    case RETURN: return "RETURN";
-    case OPLESSEQ: return "OPLESSEQ";
-    case GOTO: return "GOTO";
-    case IF: return "IF";
-    case NOT: return "NOT";
-    case AND: return "AND";
-    case VAR: return "VAR";
-    case '=': return "=";
-    case '*': return "*";
-    case '-': return "-";
-    case '+': return "+";
-    case '#': return "#";
-    default: return "???";
+int SimpleExprAST::checkSymbols(Scope *scope) {
+    int j = exprPool->checkSymbols(m_lhs, scope);
+    if (m_rhs != EXPR_NONE) {
+        j += exprPool->checkSymbols(m_rhs, scope);
     }
+    return j;
 }
 
-IfExprAST::IfExprAST(ExprAST *cond, ExprList *then)
-    : ExprAST(), m_cond(cond)
-{
-    if (then != NULL) {
-        m_then = then->get();
-        delete then;
+void SimpleExprAST::collectAddressTaken(set<sym_t> &vars) const {
+    /* Assigning to a variable does not need its address. */
+    if ((m_op != VAR && m_op != '=') || exprPool->kind(m_lhs) != ExprAddr) {
+        exprPool->collectAddressTaken(m_lhs, vars);
+    }
+    if (m_rhs != EXPR_NONE) {
+        exprPool->collectAddressTaken(m_rhs, vars);
     }
 }
 
-string IfExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << "IF; " << m_scope->toString();
-    s << m_cond->toString(level + 1);
-    for (unsigned int i = 0; i < m_then.size(); i++) {
-        s << m_then[i]->toString(level + 1);
+bool SimpleExprAST::jumps() const {
+    return m_op == RETURN || m_op == GOTO;
+}
+
+Value *SimpleExprAST::codegen() {
+    const ExprPool &p = *exprPool;
+    Function *f = cg->builder.GetInsertBlock()->getParent();
+    Value *v;
+
+    switch (m_op) {
+    case VAR:
+    case '=': {
+        if (p.kind(m_lhs) == ExprAddr) {
+            Value *r = codegenExpr(m_rhs);
+            return (r != 0 ? assign(p.sym(m_lhs), r) : 0);
+        }
+        Value *l = codegenExpr(m_lhs);
+        Value *r = (l != 0 ? codegenExpr(m_rhs) : 0);
+        if (r == 0) {
+            return 0;
+        }
+        l = cg->builder.CreateIntToPtr(l, Type::getInt64PtrTy(cg->context), "ptrtmp");
+        return cg->builder.CreateStore(r, l);
+    }
+    case RETURN:
+        /* Nothing in memory may be used by a callee in tail position. */
+        if (cg->inMemory.empty() && p.kind(m_lhs) == ExprCall) {
+            return codegenTail(m_lhs);
+        }
+        v = codegenExpr(m_lhs);
+        if (v == 0) {
+            return 0;
+        }
+        v = cg->builder.CreateRet(v);
+        startDummyBlock(f);
+        return v;
+    case GOTO: {
+        v = codegenExpr(m_lhs);
+        if (v == 0) {
+            return 0;
+        }
+        BasicBlock *blk = dynamic_cast<BasicBlock *>(v);
+        assert(blk != NULL);
+        v = cg->builder.CreateBr(blk);
+
+        /* Similar to RETURN, a goto requires entering a new dummy block
+           to prevent duplicate terminators in one block. */
+        startDummyBlock(f);
+        return v;
+    }
+    default:
+        return codegenExpr(m_lhs);
     }
-    return s.str();
 }
 
-IfExprAST::~IfExprAST() {
-    delete m_cond;
+IfExprAST::IfExprAST(expr_t cond, ExprList *then)
+    : ExprAST(), m_cond(cond), m_scope(NULL)
+{
+    if (then != NULL) {
+        then->take(m_then);
+    }
+}
+
+void IfExprAST::dump(AstDumper &d) const {
+    d.begin("IF");
+    exprPool->dump(m_cond, d);
     for (unsigned int i = 0; i < m_then.size(); i++) {
-        delete m_then[i];
+        m_then[i]->dump(d);
     }
+    d.end();
 }
 
 vector<Symbol> IfExprAST::collectDefinedSymbols() {
-    m_scope = new Scope;
-    vector<Symbol> syms;
-    for (unsigned int i = 0; i < m_then.size(); i++) {
-        vector<Symbol> tsyms = m_then[i]->collectDefinedSymbols();
-        syms.insert(syms.begin(), tsyms.begin(), tsyms.end());
+    /* Statements are visited back to front, which keeps the
+       symbol order of the former prepending version. */
+    vector<Symbol> defs;
+    for (unsigned int i = m_then.size(); i > 0; i--) {
+        vector<Symbol> tsyms = m_then[i - 1]->collectDefinedSymbols();
+        defs.insert(defs.end(), tsyms.begin(), tsyms.end());
     }
-    for (vector<Symbol>::iterator it = syms.begin(); it != syms.end(); ) {
-        Symbol s = *it;
-        if (s.type == Label) {
-            it++;
-            continue;
+
+    /* Variables stay in this scope, labels are passed on to the parent. */
+    m_scope = new Scope;
+    vector<Symbol> labels;
+    for (unsigned int i = 0; i < defs.size(); i++) {
+        if (defs[i].type == Label) {
+            labels.push_back(defs[i]);
+        } else {
+            m_scope->insert(defs[i]);
         }
-        m_scope->insert(s);
-        it = syms.erase(it);
     }
 
-    return syms;
+    return labels;
 }
 
 int IfExprAST::checkSymbols(Scope *scope) {
@@ -435,45 +1424,64 @@ int IfExprAST::checkSymbols(Scope *scope) {
     /* lhs is always in the parent scope.  */
 
     int j = 0;
-    j += m_cond->checkSymbols(scope);
-
-    /* rhs starts a new (merged) scope in IF statements. */
+    j += exprPool->checkSymbols(m_cond, scope);
 
-    Scope s;
-    s.merge(m_scope);
-    s.merge(scope);
+    /* rhs starts a new scope in IF statements, layered on the parent. */
 
+    m_scope->enter();
     for (unsigned int i = 0; i < m_then.size(); i++) {
-        j += m_then[i]->checkSymbols(&s);
+        j += m_then[i]->checkSymbols(m_scope);
     }
+    m_scope->leave();
     return j;
 }
 
+void IfExprAST::collectAddressTaken(set<sym_t> &vars) const {
+    exprPool->collectAddressTaken(m_cond, vars);
+    for (unsigned int i = 0; i < m_then.size(); i++) {
+        m_then[i]->collectAddressTaken(vars);
+    }
+}
+
 Value *IfExprAST::codegen() {
-    Value *v = m_cond->codegen();
-    if (v == 0) {
-        return 0;
+    /* Left by fold() for its scope, the statements simply run. */
+    long c;
+    bool always = exprPool->constantValue(m_cond, c) && c != 0;
+
+    Value *v = NULL;
+    if (!always) {
+        v = codegenExpr(m_cond);
+        if (v == 0) {
+            return 0;
+        }
     }
 
-    /* Create all local vars on the stack and store them in namedValues. */
+    /* Create local vars which have their address taken on the stack
+       and store them in namedValues. */
 
-    Function *f = builder.GetInsertBlock()->getParent();
+    Function *f = cg->builder.GetInsertBlock()->getParent();
 
-    const vector<sym_t> variables = m_scope->variables();
+    const SymVector &variables = m_scope->variables();
     for (unsigned int i = 0; i < variables.size(); i++) {
-        AllocaInst *alloca = createEntryBlockAlloca(f, variables[i]);
-        namedValues[variables[i]] = alloca;
+        if (cg->inMemory.count(variables[i]) != 0) {
+            AllocaInst *alloca = createEntryBlockAlloca(f, variables[i]);
+            cg->namedValues[variables[i]] = alloca;
+        }
     }
 
-    v = builder.CreateICmpNE(v, ConstantInt::get(getGlobalContext(), APInt(64, 0, true)), "ifcond");
+    BasicBlock *mergeb = NULL;
+    if (!always) {
+        v = cg->builder.CreateICmpNE(v, ConstantInt::get(cg->context, APInt(64, 0, true)), "ifcond");
 
-    BasicBlock *thenb = BasicBlock::Create(getGlobalContext(), "then", f);
-    BasicBlock *mergeb = BasicBlock::Create(getGlobalContext(), "ifcont");
+        BasicBlock *thenb = BasicBlock::Create(cg->context, "then", f);
+        mergeb = BasicBlock::Create(cg->context, "ifcont");
 
-    builder.CreateCondBr(v, thenb, mergeb);
+        cg->builder.CreateCondBr(v, thenb, mergeb);
 
-    /* THEN block. */
-    builder.SetInsertPoint(thenb);
+        /* THEN block. Its only predecessor is the condition. */
+        cg->builder.SetInsertPoint(thenb);
+        sealBlock(thenb);
+    }
 
     Value *thenv = NULL;
     for (unsigned int i = 0; i < m_then.size(); i++) {
@@ -483,193 +1491,415 @@ Value *IfExprAST::codegen() {
         }
     }
 
-    builder.CreateBr(mergeb);
+    if (!always) {
+        cg->builder.CreateBr(mergeb);
 
-    /* Merge block. */
-    f->getBasicBlockList().push_back(mergeb);
-    builder.SetInsertPoint(mergeb);
+        /* Merge block. */
+        f->getBasicBlockList().push_back(mergeb);
+        cg->builder.SetInsertPoint(mergeb);
+        sealBlock(mergeb);
+    }
 
     if (thenv == NULL) {
-        thenv = ConstantInt::get(getGlobalContext(), APInt(64, 0, true));
+        thenv = ConstantInt::get(cg->context, APInt(64, 0, true));
     }
 
     return thenv;
 }
 
-string BinaryExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << opstr(m_op) << endl;
-    s << m_lhs->toString(level + 1);
-    s << m_rhs->toString(level + 1);
-    return s.str();
-}
+/* One node per line, children indented below their parent. */
+class TreeDumper : public AstDumper {
+    FILE *m_out;
+    int m_level;
+    bool m_open;
+public:
+    TreeDumper(FILE *out) : m_out(out), m_level(0), m_open(false) {}
+    virtual void begin(const char *kind) {
+        if (m_open) {
+            fputc('\n', m_out);
+        }
+        fprintf(m_out, "%*s%s", m_level * INDENT, "", kind);
+        m_level++;
+        m_open = true;
+    }
+    virtual void attr(const char *s) { fprintf(m_out, " %s", s); }
+    virtual void attr(long n) { fprintf(m_out, " %ld", n); }
+    virtual void end() {
+        if (m_open) {
+            fputc('\n', m_out);
+        }
+        m_level--;
+        m_open = false;
+    }
+};
+
+/* Each top level node becomes one S-expression on its own line. */
+class SexprDumper : public AstDumper {
+    FILE *m_out;
+    int m_level;
+    bool m_space;
+public:
+    SexprDumper(FILE *out) : m_out(out), m_level(0), m_space(false) {}
+    virtual void begin(const char *kind) {
+        fprintf(m_out, "%s(%s", (m_space ? " " : ""), kind);
+        m_level++;
+        m_space = true;
+    }
+    virtual void attr(const char *s) { fprintf(m_out, " %s", s); }
+    virtual void attr(long n) { fprintf(m_out, " %ld", n); }
+    virtual void end() {
+        fputc(')', m_out);
+        if (--m_level == 0) {
+            fputc('\n', m_out);
+            m_space = false;
+        }
+    }
+};
 
-BinaryExprAST::~BinaryExprAST() {
-    delete m_lhs;
-    delete m_rhs;
+void dumpAst(const ExprAST *n, FILE *out, enum DumpFormat fmt) {
+    if (fmt == DumpSexpr) {
+        SexprDumper d(out);
+        n->dump(d);
+    } else {
+        TreeDumper d(out);
+        n->dump(d);
+    }
 }
 
-vector<Symbol> BinaryExprAST::collectDefinedSymbols() {
-    switch (m_op) {
-    case VAR: return m_lhs->collectDefinedSymbols();
-    default: break;
+/* Folds a list of statements. Statements after a return or goto are
+   dropped up to the next one which defines a label. */
+static void foldStatements(ExprVector &stats) {
+    unsigned int n = 0;
+    bool reachable = true;
+    for (unsigned int i = 0; i < stats.size(); i++) {
+        if (!reachable && !stats[i]->definesLabels()) {
+            continue;
+        }
+        ExprAST *s = stats[i]->fold();
+        if (s != NULL) {
+            stats[n++] = s;
+            reachable = !s->jumps();
+        }
     }
-    return vector<Symbol>();
+    stats.resize(n);
 }
 
-int BinaryExprAST::checkSymbols(Scope *scope) {
-    assert(scope != NULL);
+ExprAST *FunctionExprAST::fold() {
+    UsePool use(m_exprs);
+    foldStatements(m_stats);
+    return this;
+}
 
-    int j = 0;
-    j += m_lhs->checkSymbols(scope);
-    j += m_rhs->checkSymbols(scope);
-    return j;
+ExprAST *StatementExprAST::fold() {
+    ExprAST *s = m_stat->fold();
+    if (s == NULL) {
+        /* The label itself must stay. */
+        return m_labels.empty() ? NULL : this;
+    }
+    m_stat = s;
+    return this;
 }
 
-Value *BinaryExprAST::codegen() {
-    Value *l = m_lhs->codegen();
-    Value *r = m_rhs->codegen();
-    if (l == 0 || r == 0) {
-        return 0;
+ExprAST *IfExprAST::fold() {
+    exprPool->fold(m_cond);
+    foldStatements(m_then);
+    long c;
+    if (exprPool->constantValue(m_cond, c) && c == 0 && !definesLabels()) {
+        return NULL;
     }
+    return this;
+}
 
-    switch (m_op) {
-    case VAR:
-    case '=':
-        l = builder.CreateIntToPtr(l, Type::getInt64PtrTy(getGlobalContext()), "ptrtmp");
-        return builder.CreateStore(r, l);
-    case '*': return builder.CreateMul(l, r, "multmp");
-    case '+': return builder.CreateAdd(l, r, "addtmp");
-    case AND: return builder.CreateAnd(l, r, "andtmp");
-    case OPLESSEQ:
-        l = builder.CreateICmpSLE(l, r, "cmptmp");
-        return builder.CreateZExt(l, Type::getInt64Ty(getGlobalContext()), "csttmp");
-    case '#':
-        l = builder.CreateICmpNE(l, r);
-        return builder.CreateZExt(l, Type::getInt64Ty(getGlobalContext()), "csttmp");
-    default: return errorV("Unknown binary operator.");
-    }
-}
-
-string UnaryExprAST::toString(int level) const {
-    stringstream s;
-    s << string(level * INDENT, ' ') << opstr(m_op) << endl;
-    s << m_arg->toString(level + 1);
-    return s.str();
+bool IfExprAST::definesLabels() const {
+    for (unsigned int i = 0; i < m_then.size(); i++) {
+        if (m_then[i]->definesLabels()) {
+            return true;
+        }
+    }
+    return false;
 }
 
-UnaryExprAST::~UnaryExprAST() {
-    delete m_arg;
+/* Arithmetic wraps around like in the generated code. */
+static long foldBinary(op_t op, long l, long r) {
+    switch (op) {
+    case '*': return (long)((unsigned long)l * (unsigned long)r);
+    case '+': return (long)((unsigned long)l + (unsigned long)r);
+    case AND: return l & r;
+    case OPLESSEQ: return l <= r;
+    case '#': return l != r;
+    default: assert(0); return 0;
+    }
 }
 
-Value *UnaryExprAST::codegen() {
-    Value *v = m_arg->codegen();
-    if (v == 0) {
-        return 0;
+void ExprPool::copy(expr_t to, expr_t from) {
+    m_kind[to] = m_kind[from];
+    m_op[to] = m_op[from];
+    m_a[to] = m_a[from];
+    m_b[to] = m_b[from];
+}
+
+/* Operands are folded before the expressions using them. What replaces
+   an expression is copied over it, and the entries it came from are
+   dropped. A constant result reuses the slot of an operand. */
+void ExprPool::fold(expr_t e) {
+    for (expr_t i = first(e); i <= e; i++) {
+        expr_t a = m_a[i], b = m_b[i];
+        long l, r;
+
+        if (m_kind[i] == ExprBinary) {
+            bool lc = constantValue(a, l);
+            bool rc = constantValue(b, r);
+            op_t op = m_op[i];
+            if (lc && rc) {
+                copy(i, a);
+                m_consts[m_a[i]] = foldBinary(op, l, r);
+            } else if ((op == '*' && rc && r == 1) || (op == '+' && rc && r == 0)) {
+                copy(i, a);
+            } else if ((op == '*' && lc && l == 1) || (op == '+' && lc && l == 0)) {
+                copy(i, b);
+            } else {
+                continue;
+            }
+            kill(a);
+            kill(b);
+        } else if (m_kind[i] == ExprUnary && (m_op[i] == NOT || m_op[i] == UNARYMINUS)) {
+            if (constantValue(a, l)) {
+                op_t op = m_op[i];
+                copy(i, a);
+                m_consts[m_a[i]] = (op == NOT ? ~l : (long)(0 - (unsigned long)l));
+                kill(a);
+            } else if (m_kind[a] == ExprUnary && m_op[a] == m_op[i]) {
+                /* not not x and -(-x) are x. */
+                expr_t x = m_a[a];
+                copy(i, x);
+                kill(a);
+                kill(x);
+            }
+        }
     }
+}
 
-    switch (m_op) {
-    case NOT: return builder.CreateNot(v, "nottmp");
-    case UNARYMINUS: return builder.CreateNeg(v, "negtmp");
-    case RETURN: {
-        v = builder.CreateRet(v);
-        Function *f = builder.GetInsertBlock()->getParent();
-        BasicBlock *dummyb = BasicBlock::Create(getGlobalContext(), "dummy", f);
-        builder.SetInsertPoint(dummyb);
-        return v;
+ExprAST *SimpleExprAST::fold() {
+    exprPool->fold(m_lhs);
+    if (m_rhs != EXPR_NONE) {
+        exprPool->fold(m_rhs);
     }
-    case DEREF:
-        v = builder.CreateIntToPtr(v, Type::getInt64PtrTy(getGlobalContext()), "ptrtmp");
-        return builder.CreateLoad(v, "drftmp");
-    case GOTO: {
-        BasicBlock *blk = dynamic_cast<BasicBlock *>(v);
-        assert(blk != NULL);
-        v = builder.CreateBr(blk);
+    return this;
+}
 
-        /* Similar to RETURN, a goto requires entering a new dummy block
-           to prevent duplicate terminators in one block. */
+#define SYMTAB_CHUNK (64 * 1024)
+#define SYMTAB_BUCKETS (1024)
 
-        Function *f = builder.GetInsertBlock()->getParent();
-        BasicBlock *dummyb = BasicBlock::Create(getGlobalContext(), "dummy", f);
-        builder.SetInsertPoint(dummyb);
+SymbolTable::SymbolTable() : m_buckets(SYMTAB_BUCKETS, -1), m_pos(NULL), m_free(0) {
+}
 
-        return v;
+SymbolTable::~SymbolTable() {
+    for (unsigned int i = 0; i < m_chunks.size(); i++) {
+        free(m_chunks[i]);
     }
-    default: return errorV("Unknown unary operator.");
+}
+
+/* FNV-1a. */
+unsigned int SymbolTable::hash(const char *s, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Copies s into the current chunk and terminates it. Names longer than
+   a chunk get a chunk of their own. */
+const char *SymbolTable::store(const char *s, size_t len) {
+    if (len + 1 > m_free) {
+        size_t size = (len + 1 > SYMTAB_CHUNK) ? len + 1 : SYMTAB_CHUNK;
+        m_pos = (char *)malloc(size);
+        assert(m_pos != NULL);
+        m_chunks.push_back(m_pos);
+        m_free = size;
+    }
+    char *p = m_pos;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    m_pos += len + 1;
+    m_free -= len + 1;
+    return p;
+}
+
+/* Doubles the bucket array. Keeps the load factor at or below 1/2. */
+void SymbolTable::rehash() {
+    size_t mask = m_buckets.size() * 2 - 1;
+    vector<sym_t> buckets(mask + 1, -1);
+    for (unsigned int i = 0; i < m_symbols.size(); i++) {
+        size_t j = m_symbols[i].hash & mask;
+        while (buckets[j] != -1) {
+            j = (j + 1) & mask;
+        }
+        buckets[j] = i;
     }
+    m_buckets.swap(buckets);
 }
 
-sym_t SymbolTable::insert(string s) {
-    unsigned int i;
-    for (i = 0; i < m_symbols.size(); i++) {
-        if (s == m_symbols[i]) {
-            return i;
+sym_t SymbolTable::insert(const char *s, size_t len) {
+    unsigned int h = hash(s, len);
+    size_t mask = m_buckets.size() - 1;
+    size_t j = h & mask;
+    while (m_buckets[j] != -1) {
+        const Entry &e = m_symbols[m_buckets[j]];
+        if (e.hash == h && e.len == len && memcmp(e.name, s, len) == 0) {
+            return m_buckets[j];
         }
+        j = (j + 1) & mask;
+    }
+
+    sym_t i = m_symbols.size();
+    Entry e = { store(s, len), len, h };
+    m_symbols.push_back(e);
+    m_buckets[j] = i;
+
+    if (m_symbols.size() * 2 > m_buckets.size()) {
+        rehash();
     }
-    m_symbols.push_back(s);
     return i;
 }
 
-string SymbolTable::get(sym_t i) const {
+const char *SymbolTable::get(sym_t i) const {
     assert(i < (int)m_symbols.size());
-    return m_symbols[i];
+    return m_symbols[i].name;
 }
 
 string SymbolTable::toString() const {
     stringstream s;
     s << "Symbol table contents:" << endl;
     for (unsigned int i = 0; i < m_symbols.size(); i++) {
-        s << i << ": " << m_symbols[i] << endl;
+        s << i << ": " << m_symbols[i].name << endl;
     }
     return s.str();
 }
 
-void Scope::merge(const Scope *that) {
-    insertAll(that->m_vars, Var);
-    insertAll(that->m_labels, Label);
+/* Per symbol state shared by all scopes. defined holds the generation
+   of the last scope a symbol was inserted into, which makes redefinition
+   checks constant time without ever clearing the table. visible holds
+   the type (plus one) of symbols in entered scopes, or zero. */
+struct ScopeMarks {
+    vector<unsigned int> defined;
+    vector<unsigned char> visible;
+    unsigned int gen;
+    /* Redefinitions reported since the last checkFunction(). */
+    int errors;
+
+    void fit(sym_t s) {
+        if (s >= (sym_t)defined.size()) {
+            size_t n = (syms->size() > (size_t)s) ? syms->size() : s + 1;
+            defined.resize(n, 0);
+            visible.resize(n, 0);
+        }
+    }
+};
+
+/* Each thread checking symbols owns a table. */
+static __thread ScopeMarks *marks = NULL;
+
+Scope::Scope() {
+    if (++marks->gen == 0) {
+        std::fill(marks->defined.begin(), marks->defined.end(), 0);
+        marks->gen = 1;
+    }
+    m_gen = marks->gen;
+}
+
+static void redefinition(sym_t s, int line) {
+    diags->error(ERR_SCOPE, line, "Redefinition of symbol '%s'", syms->get(s));
+    marks->errors++;
 }
 
 void Scope::insert(Symbol s) {
-    if (contains(s.sym)) {
-        fprintf(stderr, "Redefinition of symbol '%s'\n",
-                syms.get(s.sym).c_str());
-        exit(ERR_SCOPE);
+    assert(m_gen == marks->gen);
+    marks->fit(s.sym);
+    if (marks->defined[s.sym] == m_gen) {
+        redefinition(s.sym, s.line);
+        return;
+    }
+    marks->defined[s.sym] = m_gen;
+    if (s.type == Var) {
+        m_vars.push_back(s.sym);
+        m_varLines.push_back(s.line);
+    } else {
+        m_labels.push_back(s.sym);
+        m_labelLines.push_back(s.line);
     }
-    vector<sym_t> &v = (s.type == Var) ? m_vars : m_labels;
-    v.push_back(s.sym);
 }
 
-void Scope::insertAll(vector<sym_t> v, enum SymType t) {
+void Scope::insertAll(const SymVector &v, enum SymType t, int line) {
     for (unsigned int i = 0; i < v.size(); i++) {
-        insert(Symbol(v[i], t));
+        insert(Symbol(v[i], t, line));
     }
 }
 
-void Scope::insertAll(vector<Symbol> v) {
+void Scope::insertAll(const vector<Symbol> &v) {
     for (unsigned int i = 0; i < v.size(); i++) {
         insert(v[i]);
     }
 }
 
-int Scope::contains(sym_t s, enum SymType t) const {
-    const vector<sym_t> &v = (t == Var) ? m_vars : m_labels;
-    for (unsigned int i = 0; i < v.size(); i++) {
-        if (s == v[i]) {
-            return 1;
+void Scope::drop(SymVector &v, LineVector &lines, unsigned int i) {
+    v.erase(v.begin() + i);
+    lines.erase(lines.begin() + i);
+}
+
+/* A symbol of a nested scope may not shadow one of an enclosing scope.
+   Such a symbol is dropped, so leave() does not hide the outer one. */
+void Scope::enter() {
+    for (unsigned int i = 0; i < m_vars.size(); ) {
+        marks->fit(m_vars[i]);
+        if (marks->visible[m_vars[i]]) {
+            redefinition(m_vars[i], m_varLines[i]);
+            drop(m_vars, m_varLines, i);
+            continue;
         }
+        marks->visible[m_vars[i]] = Var + 1;
+        i++;
     }
-    return 0;
+    for (unsigned int i = 0; i < m_labels.size(); ) {
+        marks->fit(m_labels[i]);
+        if (marks->visible[m_labels[i]]) {
+            redefinition(m_labels[i], m_labelLines[i]);
+            drop(m_labels, m_labelLines, i);
+            continue;
+        }
+        marks->visible[m_labels[i]] = Label + 1;
+        i++;
+    }
+}
+
+void Scope::leave() const {
+    for (unsigned int i = 0; i < m_vars.size(); i++) {
+        marks->visible[m_vars[i]] = 0;
+    }
+    for (unsigned int i = 0; i < m_labels.size(); i++) {
+        marks->visible[m_labels[i]] = 0;
+    }
+}
+
+int Scope::contains(sym_t s, enum SymType t) const {
+    return (s < (sym_t)marks->visible.size() && marks->visible[s] == t + 1);
 }
 
-int Scope::contains(sym_t s) const {
-    return (contains(s, Var) || contains(s, Label));
+int checkFunction(ExprAST *fn) {
+    marks->errors = 0;
+    phaseBegin(PhaseCheck);
+    fn->collectDefinedSymbols();
+    int err = fn->checkSymbols(NULL);
+    phaseEnd();
+    return err + marks->errors;
 }
 
-const vector<sym_t> &Scope::variables() const {
+const SymVector &Scope::variables() const {
     return m_vars;
 }
 
-const vector<sym_t> &Scope::labels() const {
+const SymVector &Scope::labels() const {
     return m_labels;
 }
 
@@ -677,8 +1907,538 @@ string Scope::toString() const {
     stringstream s;
     s << "Current scope: ";
     for (unsigned int i = 0; i < m_vars.size(); i++) {
-        s << syms.get(m_vars[i]) << ",";
+        s << syms->get(m_vars[i]) << ",";
     }
     s << endl;
     return s.str();
 }
+
+#define ARENA_CHUNK (64 * 1024)
+/* Enough for pointers and longs, which is all the tree holds. */
+#define ARENA_ALIGN (8)
+
+static size_t arena_round(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+Arena::Arena() : m_pos(NULL), m_free(0) {
+}
+
+Arena::~Arena() {
+    for (unsigned int i = 0; i < m_chunks.size(); i++) {
+        free(m_chunks[i]);
+    }
+}
+
+void *Arena::allocate(size_t n) {
+    n = arena_round(n);
+    if (n > m_free) {
+        /* malloc returns memory aligned for any type, which
+           covers ARENA_ALIGN. */
+        size_t size = (n > ARENA_CHUNK) ? n : ARENA_CHUNK;
+        m_pos = (char *)malloc(size);
+        assert(m_pos != NULL);
+        m_chunks.push_back(m_pos);
+        m_free = size;
+    }
+    void *p = m_pos;
+    m_pos += n;
+    m_free -= n;
+    return p;
+}
+
+void Arena::deallocate(void *p, size_t n) {
+    n = arena_round(n);
+    if ((char *)p + n == m_pos) {
+        m_pos -= n;
+        m_free += n;
+    }
+}
+
+/* Keeps the first chunk, so compiling a sequence of small
+   functions does not touch malloc at all. */
+void Arena::reset() {
+    if (m_chunks.empty()) {
+        return;
+    }
+    for (unsigned int i = 1; i < m_chunks.size(); i++) {
+        free(m_chunks[i]);
+    }
+    m_chunks.resize(1);
+    m_pos = m_chunks[0];
+    m_free = ARENA_CHUNK;
+}
+
+/* Bump when the generated code changes, to invalidate old cache entries. */
+#define CACHE_VERSION "2"
+
+static long long cacheHits;
+static long long cacheMisses;
+
+/* Feeds a tree into two 64 bit multiplicative hashes with different
+   seeds and multipliers. If text is given, everything hashed is appended
+   to it as well. */
+class HashDumper : public AstDumper {
+    unsigned long long m_h[2];
+    string *m_text;
+public:
+    HashDumper(string *text = NULL) : m_text(text) {
+        m_h[0] = 14695981039346656037ULL;
+        m_h[1] = 0x9e3779b97f4a7c15ULL;
+    }
+    void add(const void *p, size_t n) {
+        const unsigned char *b = (const unsigned char *)p;
+        if (m_text != NULL) {
+            m_text->append((const char *)p, n);
+        }
+        for (size_t i = 0; i < n; i++) {
+            m_h[0] = (m_h[0] ^ b[i]) * 1099511628211ULL;
+            m_h[1] = (m_h[1] ^ b[i]) * 0xff51afd7ed558ccdULL;
+        }
+    }
+    void add(const char *s) { add(s, strlen(s) + 1); }
+    virtual void begin(const char *kind) { add("(", 1); add(kind); }
+    virtual void attr(const char *s) { add("s", 1); add(s); }
+    virtual void attr(long n) { add("n", 1); add(&n, sizeof(n)); }
+    virtual void end() { add(")", 1); }
+    string key() const {
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", m_h[0], m_h[1]);
+        return buf;
+    }
+};
+
+/* Cache key of a checked function. Covers its structure, including names
+   by their spelling, and all settings which affect the generated code.
+   Sets text to what the key is a hash of, which is stored along with the
+   entry, so that a hash collision cannot hand out another function. */
+static string cacheKey(const ExprAST *fn, string &text) {
+    HashDumper h(&text);
+    h.add(CACHE_VERSION);
+    h.add(TARGET_TRIPLE);
+    h.add(&optLevel, sizeof(optLevel));
+    fn->dump(h);
+    return h.key();
+}
+
+string sourceKey(const char *text, size_t len) {
+    HashDumper h;
+    h.add(CACHE_VERSION);
+    h.add(TARGET_TRIPLE);
+    h.add(&optLevel, sizeof(optLevel));
+    h.add(&asmVerbosity, sizeof(asmVerbosity));
+    h.add(text, len);
+    return h.key();
+}
+
+/* Generates code for the checked function fn into a module of its own
+   and returns the module as bitcode. With a cache, the bitcode is taken
+   from there if possible and stored otherwise. Returns nonzero on error. */
+static int codegenBitcode(ExprAST *fn, LLVMContext &context, FunctionCache *cache,
+                          string &bitcode) {
+    string key, text;
+    if (cache != NULL) {
+        key = cacheKey(fn, text);
+        if (cache->lookup(key, text, bitcode)) {
+            __sync_fetch_and_add(&cacheHits, 1);
+            return 0;
+        }
+        __sync_fetch_and_add(&cacheMisses, 1);
+    }
+
+    phaseBegin(PhaseCodegen);
+    Module *module = new Module("mainmodule", context);
+    CodegenContext *saved = cg;
+    Value *v;
+    {
+        CodegenContext c(context, module);
+        cg = &c;
+        v = fn->codegen();
+        cg = saved;
+    }
+    if (v != 0) {
+        raw_string_ostream os(bitcode);
+        WriteBitcodeToFile(module, os);
+        os.flush();
+    }
+    delete module;
+    phaseEnd();
+
+    if (v == 0) {
+        fprintf(stderr, "codegen() returned 0.\n");
+        return 1;
+    }
+    if (cache != NULL) {
+        cache->store(key, text, bitcode);
+    }
+    return 0;
+}
+
+/* Links the bitcode of a single function into m. The linker appends a
+   definition which replaces a declaration; it is moved back to where
+   the declaration was, as if its code had been generated into m. */
+static void linkBitcode(Module *m, const string &bitcode) {
+    string err;
+    MemoryBuffer *buf = MemoryBuffer::getMemBuffer(bitcode, "", false);
+    Module *src = ParseBitcodeFile(buf, m->getContext(), &err);
+    delete buf;
+    if (src == NULL) {
+        fprintf(stderr, "%s\n", err.c_str());
+        exit(ERR_SCOPE);
+    }
+
+    string name;
+    Function *next = NULL;
+    for (Module::iterator f = src->begin(); f != src->end(); ++f) {
+        Function *decl = m->getFunction(f->getName());
+        if (!f->isDeclaration() && decl != NULL) {
+            Module::iterator it(decl);
+            if (++it != m->end()) {
+                name = f->getName().str();
+                next = it;
+            }
+        }
+    }
+
+    if (Linker::LinkModules(m, src, Linker::DestroySource, &err)) {
+        fprintf(stderr, "%s\n", err.c_str());
+        exit(ERR_SCOPE);
+    }
+    delete src;
+
+    if (next != NULL) {
+        Module::FunctionListType &fl = m->getFunctionList();
+        Function *f = m->getFunction(name);
+        fl.remove(f);
+        fl.insert(Module::iterator(next), f);
+    }
+}
+
+int codegenCached(CompilerSession *s, ExprAST *fn) {
+    string bitcode;
+    if (codegenBitcode(fn, s->context, s->opts.cache, bitcode) != 0) {
+        return ERR_SCOPE;
+    }
+    phaseBegin(PhaseLink);
+    linkBitcode(s->module, bitcode);
+    phaseEnd();
+    return 0;
+}
+
+struct CodegenJob {
+    ExprAST *fn;
+    string bitcode;
+    int err;
+};
+
+struct CodegenQueue {
+    vector<CodegenJob> *jobs;
+    SymbolTable *syms;
+    Diagnostics *diags;
+    FunctionCache *cache;
+    int next;
+};
+
+/* LLVM contexts are not thread safe, so each worker generates code into
+   modules of its own context and hands them back as bitcode. */
+static void *codegenWorker(void *arg) {
+    CodegenQueue *q = (CodegenQueue *)arg;
+    LLVMContext context;
+    ScopeMarks m;
+    Arena a;
+    marks = &m;
+    astArena = &a;
+    syms = q->syms;
+    diags = q->diags;
+
+    int i;
+    while ((i = __sync_fetch_and_add(&q->next, 1)) < (int)q->jobs->size()) {
+        CodegenJob &job = (*q->jobs)[i];
+
+        if (checkFunction(job.fn) != 0) {
+            job.err = ERR_SCOPE;
+            continue;
+        }
+        if (optLevel > 0) {
+            job.fn->fold();
+        }
+        if (codegenBitcode(job.fn, context, q->cache, job.bitcode) != 0) {
+            job.err = ERR_SCOPE;
+        }
+    }
+
+    /* Scopes built by this thread go away with its arena. */
+    astArena = NULL;
+    marks = NULL;
+    syms = NULL;
+    diags = NULL;
+    return NULL;
+}
+
+int codegenParallel(CompilerSession *s, int nthreads) {
+    const vector<ExprAST *> &fns = s->pending;
+    vector<CodegenJob> jobs(fns.size());
+    for (unsigned int i = 0; i < fns.size(); i++) {
+        jobs[i].fn = fns[i];
+        jobs[i].err = 0;
+    }
+
+    CodegenQueue q;
+    q.jobs = &jobs;
+    q.syms = &s->symbols;
+    q.diags = s->diags;
+    q.cache = s->opts.cache;
+    q.next = 0;
+
+    if (!llvm_is_multithreaded()) {
+        llvm_start_multithreaded();
+    }
+    vector<pthread_t> threads(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, codegenWorker, &q) != 0) {
+            perror("pthread_create");
+            exit(ERR_SCOPE);
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    /* Fail on the first broken function, as the serial mode does. */
+    for (unsigned int i = 0; i < jobs.size(); i++) {
+        if (jobs[i].err) {
+            return jobs[i].err;
+        }
+    }
+
+    /* The serial mode creates functions in the order they are first
+       mentioned in, either by definition or by call. Record that order
+       while linking and restore it afterwards, since the linker appends
+       definitions that replace declarations. */
+    phaseBegin(PhaseLink);
+    vector<string> order;
+    set<string> seen;
+    for (unsigned int i = 0; i < jobs.size(); i++) {
+        string err;
+        MemoryBuffer *buf = MemoryBuffer::getMemBuffer(jobs[i].bitcode, "", false);
+        Module *m = ParseBitcodeFile(buf, s->context, &err);
+        delete buf;
+        if (m == NULL) {
+            fprintf(stderr, "%s\n", err.c_str());
+            exit(ERR_SCOPE);
+        }
+
+        for (Module::iterator f = m->begin(); f != m->end(); ++f) {
+            string name = f->getName().str();
+            if (seen.insert(name).second) {
+                order.push_back(name);
+            }
+        }
+
+        if (Linker::LinkModules(s->module, m, Linker::DestroySource, &err)) {
+            fprintf(stderr, "%s\n", err.c_str());
+            exit(ERR_SCOPE);
+        }
+        delete m;
+        string().swap(jobs[i].bitcode);
+    }
+
+    Module::FunctionListType &fl = s->module->getFunctionList();
+    for (unsigned int i = 0; i < order.size(); i++) {
+        Function *f = s->module->getFunction(order[i]);
+        fl.remove(f);
+        fl.push_back(f);
+    }
+    phaseEnd();
+    return 0;
+}
+
+CompilerSession::CompilerSession(const CompileOptions &o, FILE *f, const char *path)
+    : opts(o), out(f), module(new Module("mainmodule", context)),
+      cg(new CodegenContext(context, module)), marks(new ScopeMarks()),
+      lexer(NULL), diags(new Diagnostics(path, o.diagFormat, o.errorLimit)), reported(0),
+      exprs(NULL),
+      bytecode(o.interpret ? new BytecodeProgram(o.tiered ? this : NULL) : NULL),
+      jit(NULL), asmOut(new raw_fd_ostream(fileno(f), false)), target(NULL),
+      asmPasses(NULL), asmStream(NULL), m_err(0)
+{
+}
+
+CompilerSession::~CompilerSession() {
+    /* Stops the compiler thread of the interpreter first. */
+    delete bytecode;
+    delete jit;
+    delete asmPasses;
+    delete asmStream;
+    delete target;
+    delete asmOut;
+    delete marks;
+    delete cg;
+    delete module;
+    delete diags;
+}
+
+void CompilerSession::activate() {
+    syms = &symbols;
+    astArena = &arena;
+    ::cg = cg;
+    ::marks = marks;
+    ::diags = diags;
+}
+
+void CompilerSession::deactivate() {
+    syms = NULL;
+    astArena = NULL;
+    ::cg = NULL;
+    ::marks = NULL;
+    ::diags = NULL;
+}
+
+int statsEnabled = 0;
+__thread unsigned long astNodes = 0;
+
+static const char *phaseNames[PhaseCount] = {
+    "scan", "parse", "check", "codegen", "link", "optimize", "emit"
+};
+
+/* Accumulated over all threads, in nanoseconds. */
+static long long phaseWall[PhaseCount];
+static long long phaseCpu[PhaseCount];
+static long long startWall;
+
+static long long unitNodes;
+static long long unitSymbols;
+static long long irFunctions;
+static long long irBlocks;
+static long long irInstructions;
+
+#define PHASE_DEPTH (8)
+
+/* Phases entered by the current thread and the time they were last
+   charged at. */
+static __thread enum Phase phaseStack[PHASE_DEPTH];
+static __thread int phaseDepth = 0;
+static __thread long long markWall;
+static __thread long long markCpu;
+
+static long long nsecs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Charges the time since the last mark to the innermost phase. */
+static void phaseCharge() {
+    long long w = nsecs(CLOCK_MONOTONIC);
+    long long c = nsecs(CLOCK_THREAD_CPUTIME_ID);
+    if (phaseDepth > 0) {
+        enum Phase p = phaseStack[phaseDepth - 1];
+        __sync_fetch_and_add(&phaseWall[p], w - markWall);
+        __sync_fetch_and_add(&phaseCpu[p], c - markCpu);
+    }
+    markWall = w;
+    markCpu = c;
+}
+
+void statsStart(int timePasses) {
+    statsEnabled = 1;
+    TimePassesIsEnabled = timePasses;
+    startWall = nsecs(CLOCK_MONOTONIC);
+}
+
+void statsStop() {
+    statsEnabled = 0;
+    TimePassesIsEnabled = false;
+}
+
+void phaseBegin(enum Phase p) {
+    if (!statsEnabled) {
+        return;
+    }
+    phaseCharge();
+    assert(phaseDepth < PHASE_DEPTH);
+    phaseStack[phaseDepth++] = p;
+}
+
+void phaseEnd() {
+    if (!statsEnabled) {
+        return;
+    }
+    phaseCharge();
+    assert(phaseDepth > 0);
+    phaseDepth--;
+}
+
+void countIR(Function *f) {
+    if (!statsEnabled) {
+        return;
+    }
+    long long insts = 0;
+    for (Function::iterator bb = f->begin(); bb != f->end(); ++bb) {
+        insts += bb->size();
+    }
+    __sync_fetch_and_add(&irFunctions, 1);
+    __sync_fetch_and_add(&irBlocks, (long long)f->size());
+    __sync_fetch_and_add(&irInstructions, insts);
+}
+
+void countUnit(unsigned long nodes, size_t symbols) {
+    if (!statsEnabled) {
+        return;
+    }
+    __sync_fetch_and_add(&unitNodes, (long long)nodes);
+    __sync_fetch_and_add(&unitSymbols, (long long)symbols);
+}
+
+static double secs(long long ns) {
+    return ns / 1e9;
+}
+
+static double secs(const struct timeval &tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void printStats(int json) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double wall = secs(nsecs(CLOCK_MONOTONIC) - startWall);
+    double cpu = secs(ru.ru_utime) + secs(ru.ru_stime);
+
+    if (json) {
+        fprintf(stderr, "{\"phases\": {");
+        for (int i = 0; i < PhaseCount; i++) {
+            fprintf(stderr, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+                    (i > 0 ? ", " : ""), phaseNames[i],
+                    secs(phaseWall[i]), secs(phaseCpu[i]));
+        }
+        fprintf(stderr, "}, \"total\": {\"wall\": %.6f, \"cpu\": %.6f}, "
+                "\"counters\": {\"ast_nodes\": %lld, \"symbols\": %lld, "
+                "\"functions\": %lld, \"basic_blocks\": %lld, "
+                "\"instructions\": %lld, \"cache_hits\": %lld, "
+                "\"cache_misses\": %lld}, \"peak_rss_kib\": %ld}\n",
+                wall, cpu, unitNodes, unitSymbols,
+                irFunctions, irBlocks, irInstructions, cacheHits, cacheMisses,
+                ru.ru_maxrss);
+    } else {
+        /* With -j, phase times are summed over all threads and
+           may add up to more than the total. */
+        fprintf(stderr, "%-14s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+        for (int i = 0; i < PhaseCount; i++) {
+            fprintf(stderr, "%-14s %12.6f %12.6f\n", phaseNames[i],
+                    secs(phaseWall[i]), secs(phaseCpu[i]));
+        }
+        fprintf(stderr, "%-14s %12.6f %12.6f\n\n", "total", wall, cpu);
+        fprintf(stderr, "%-14s %12lld\n", "ast nodes", unitNodes);
+        fprintf(stderr, "%-14s %12lld\n", "symbols", unitSymbols);
+        fprintf(stderr, "%-14s %12lld\n", "functions", irFunctions);
+        fprintf(stderr, "%-14s %12lld\n", "basic blocks", irBlocks);
+        fprintf(stderr, "%-14s %12lld\n", "instructions", irInstructions);
+        fprintf(stderr, "%-14s %12lld\n", "cache hits", cacheHits);
+        fprintf(stderr, "%-14s %12lld\n", "cache misses", cacheMisses);
+        fprintf(stderr, "%-14s %9ld KiB\n", "peak rss", ru.ru_maxrss);
+    }
+
+    if (TimePassesIsEnabled) {
+        TimerGroup::printAll(errs());
+    }
+}
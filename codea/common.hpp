@@ -1,29 +1,209 @@
 #include <string>
 #include <vector>
-#include <list>
+#include <set>
+#include <new>
+#include <cstddef>
+#include <cstdio>
 #include <llvm/Value.h>
 #include <llvm/Module.h>
+#include <llvm/LLVMContext.h>
 #include <llvm/PassManager.h>
 
+#include "diag.hpp"
+
+namespace llvm {
+class raw_ostream;
+class formatted_raw_ostream;
+class TargetMachine;
+}
+
 #define ERR_LEX (1)
 #define ERR_SYNTAX (2)
 #define ERR_SCOPE (3)
 
 using std::string;
 using std::vector;
-using std::list;
+using std::set;
 using namespace llvm;
 
 typedef int sym_t;
 typedef int op_t;
 
 class SymbolTable;
+class CompilerSession;
+class FunctionCache;
+class BytecodeBuilder;
+class BytecodeProgram;
+class AsmIndex;
+
+/* The symbol table of the session running on the current thread. */
+extern __thread SymbolTable *syms;
 
-extern SymbolTable syms;
-extern Module *theModule;
+/* Used if -O is not given. */
+#define OPT_LEVEL 1
+extern int optLevel;
 extern PassManager *pm;
 
-void printAsm();
+/* Initializes the native target. Must be called before sessions are
+   run on more than one thread. With verboseAsm, assembly is annotated
+   with comments. */
+void initTarget(int verboseAsm);
+
+/* Optimizes the module of s and prints it as assembly, or writes it as
+   an object file with opts.object. With more than one thread, assembly
+   is split into partitions which are compiled concurrently. */
+void printAsm(CompilerSession *s, int nthreads);
+
+/* Optimizes and prints the function body in the module of s right away,
+   then drops it. Only declarations stay behind for later calls, so memory
+   use does not grow with the size of the program. All functions go
+   through the same code generator, which numbers their local labels. */
+void streamAsm(CompilerSession *s);
+
+/* Ends the assembly printed by streamAsm(), if any. */
+void finishAsm(CompilerSession *s);
+
+/* Compiles the module of s just in time and calls its function opts.run
+   with opts.runArgs, printing the result. Functions are only compiled
+   when they are first called. Takes over the module. Returns 0, or
+   EXIT_FAILURE if there is no such function. */
+int runModule(CompilerSession *s);
+
+/* Same as streamAsm(), but appends the assembly to text. Local labels
+   are prefixed with the name of the function they belong to, so the text
+   can be combined with that of functions compiled in other runs. Does
+   nothing if no function is defined. */
+void emitFunctionAsm(CompilerSession *s, string &text);
+
+/* Key of the source text of a function in an AsmIndex. Covers the text
+   and all settings which affect the generated assembly, including its
+   comments. */
+string sourceKey(const char *text, size_t len);
+
+/* Same as runModule(), but runs the bytecode of s in the interpreter. */
+int runBytecode(CompilerSession *s);
+
+/* Compile phases timed by --stats. Time spent in a nested phase is
+   only charged to the innermost one. */
+enum Phase {
+    PhaseScan,
+    PhaseParse,
+    PhaseCheck,
+    PhaseCodegen,
+    PhaseLink,
+    PhaseOptimize,
+    PhaseEmit,
+    PhaseCount
+};
+
+/* Nonzero once statsStart() has been called. Phase timing and IR
+   counting are no-ops otherwise. */
+extern int statsEnabled;
+
+/* Number of AST nodes created by the current thread. */
+extern __thread unsigned long astNodes;
+
+/* Enables statistics and starts the total clock. With timePasses set,
+   LLVM times every pass as well. */
+void statsStart(int timePasses);
+/* Disables statistics again. */
+void statsStop();
+void phaseBegin(enum Phase p);
+void phaseEnd();
+
+/* Counts blocks and instructions of a freshly generated function. */
+void countIR(Function *f);
+
+/* Adds the AST nodes and symbols of a finished translation unit. */
+void countUnit(unsigned long nodes, size_t symbols);
+
+/* Prints timings and counters to stderr, as JSON if json is nonzero. */
+void printStats(int json);
+
+/* Bump pointer allocator for everything that lives only as long as
+   the function currently being compiled: AST nodes, their child
+   vectors and their scopes. Memory is released in bulk by reset(). */
+class Arena {
+    vector<char *> m_chunks;
+    char *m_pos;
+    size_t m_free;
+
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+public:
+    Arena();
+    ~Arena();
+    void *allocate(size_t n);
+    /* Only reclaims the most recent allocation, which is enough
+       to make growing vectors cheap. */
+    void deallocate(void *p, size_t n);
+    void reset();
+};
+
+/* The arena of the current thread. */
+extern __thread Arena *astArena;
+
+/* Standard allocator interface on top of the arena of the current thread. */
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U>
+    struct rebind { typedef ArenaAllocator<U> other; };
+
+    ArenaAllocator() {}
+    ArenaAllocator(const ArenaAllocator &) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U> &) {}
+
+    pointer address(reference x) const { return &x; }
+    const_pointer address(const_reference x) const { return &x; }
+    pointer allocate(size_type n, const void * = 0) {
+        return static_cast<pointer>(astArena->allocate(n * sizeof(T)));
+    }
+    void deallocate(pointer p, size_type n) { astArena->deallocate(p, n * sizeof(T)); }
+    size_type max_size() const { return size_t(-1) / sizeof(T); }
+    void construct(pointer p, const T &val) { new(static_cast<void *>(p)) T(val); }
+    void destroy(pointer p) { p->~T(); }
+};
+
+template <class T, class U>
+inline bool operator==(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return true; }
+template <class T, class U>
+inline bool operator!=(const ArenaAllocator<T> &, const ArenaAllocator<U> &) { return false; }
+
+class ExprAST;
+
+typedef vector<sym_t, ArenaAllocator<sym_t> > SymVector;
+typedef vector<ExprAST *, ArenaAllocator<ExprAST *> > ExprVector;
+
+/* Checks the symbols of fn and reports every error found. Returns the
+   number of errors. */
+int checkFunction(ExprAST *fn);
+
+/* Checks symbols and generates code for the pending functions of s on
+   nthreads worker threads, then links the results into its module in
+   input order. Returns 0 or the ERR_* code of the first broken function. */
+int codegenParallel(CompilerSession *s, int nthreads);
+
+/* Generates code for the checked function fn of s through the cache of
+   s. Returns 0 or ERR_SCOPE. */
+int codegenCached(CompilerSession *s, ExprAST *fn);
+
+/* Generates code for the checked functions fns into a module of their
+   own and adds it to the engine of s, which is created on first use.
+   Calls to the functions in known go to the given native code, which
+   was generated before. Stores the native entry points of fns in addrs.
+   Only one thread may use the engine of s. Returns nonzero on error. */
+int jitFunctions(CompilerSession *s, const vector<ExprAST *> &fns,
+                 const vector<std::pair<sym_t, void *> > &known, vector<void *> &addrs);
 
 enum SymType {
     Var,
@@ -35,36 +215,81 @@ enum SymType {
    than variable symbols. */
 class Symbol {
 public:
-    Symbol(sym_t s, enum SymType t) : sym(s), type(t) {}
+    Symbol(sym_t s, enum SymType t, int l) : sym(s), type(t), line(l) {}
     sym_t sym;
     enum SymType type;
+    /* Where the symbol is defined, for error messages. */
+    int line;
 };
 
 /* Used only for checking validity of scopes. Code generation
-   is simplified by using a global symbol table. */
+   is simplified by using a global symbol table.
+   Membership is tracked in dense tables indexed by sym_t. A scope must be
+   filled completely before the next one is created. During checking,
+   nested scopes are layered on top of their parents with enter() and
+   leave() instead of being merged into copies; contains() answers for
+   all currently entered scopes.
+   A redefinition is reported, and the second definition is left out. */
 class Scope {
-    vector<sym_t> m_vars;
-    vector<sym_t> m_labels;
+    typedef vector<int, ArenaAllocator<int> > LineVector;
+    SymVector m_vars;
+    SymVector m_labels;
+    LineVector m_varLines;
+    LineVector m_labelLines;
+    unsigned int m_gen;
+
+    static void drop(SymVector &v, LineVector &lines, unsigned int i);
 public:
-    void merge(const Scope *that);
+    Scope();
+    static void *operator new(size_t n) { return astArena->allocate(n); }
+    static void operator delete(void *) {}
     void insert(Symbol s);
-    void insertAll(vector<sym_t> v, enum SymType t);
-    void insertAll(vector<Symbol> v);
+    void insertAll(const SymVector &v, enum SymType t, int line);
+    void insertAll(const vector<Symbol> &v);
+    void enter();
+    void leave() const;
     int contains(sym_t s, enum SymType t) const;
-    int contains(sym_t s) const;
-    const vector<sym_t> &variables() const;
-    const vector<sym_t> &labels() const;
+    const SymVector &variables() const;
+    const SymVector &labels() const;
     string toString() const;
 };
 
+/* Output sink for ExprAST::dump(). Every node starts with begin(),
+   followed by its attributes and children, and is closed by end(). */
+class AstDumper {
+public:
+    virtual ~AstDumper() {}
+    virtual void begin(const char *kind) = 0;
+    virtual void attr(const char *s) = 0;
+    virtual void attr(long n) = 0;
+    virtual void end() = 0;
+};
+
+enum DumpFormat {
+    DumpNone,
+    DumpTree,
+    DumpSexpr
+};
+
+/* Writes the tree rooted at n to out, either indented one node per
+   line or as a single S-expression line per function. */
+void dumpAst(const ExprAST *n, FILE *out, enum DumpFormat fmt);
+
+/* Statements are nodes allocated from astArena and never destroyed one
+   by one; the whole tree is released with the arena once it has been
+   compiled. They are kept small, as a tree is walked once per pass: only
+   nodes which open a scope carry one. Expressions are not nodes of their
+   own but entries in the ExprPool of their function. */
 class ExprAST {
 public:
-    ExprAST() : m_scope(NULL) {}
+    ExprAST() { astNodes++; }
     virtual ~ExprAST() {}
 
-    /* Prints tree in human readable form. The nest level must
-     * be passed to determine indentation. */
-    virtual string toString(int level) const = 0;
+    static void *operator new(size_t n) { return astArena->allocate(n); }
+    static void operator delete(void *) {}
+
+    /* Reports the subtree to d, parents before children. */
+    virtual void dump(AstDumper &d) const = 0;
 
     /* Sets up scope tables in subtree and returns symbols which
      * are visible in parent. Processes tree bottom-up. */
@@ -75,50 +300,46 @@ public:
      * if errors occurred. */
     virtual int checkSymbols(Scope *scope) = 0;
 
-    /* Generates LLVM IR code. */
-    virtual Value *codegen() = 0;
+    /* Adds variables whose address is used as a value to vars.
+       These are kept in memory, all others are translated into
+       SSA form directly. */
+    virtual void collectAddressTaken(set<sym_t> &) const {}
 
-protected:
-    Scope *m_scope;
-};
+    /* Simplifies the checked subtree and returns what replaces it, which
+       may be the node itself. Statements return NULL if they can be left
+       out. */
+    virtual ExprAST *fold() { return this; }
 
-class NumberExprAST : public ExprAST {
-    long m_val;
-public:
-    NumberExprAST(long val) : ExprAST(), m_val(val) {}
-    virtual string toString(int level) const;
-    virtual vector<Symbol> collectDefinedSymbols() { return vector<Symbol>(); }
-    virtual int checkSymbols(Scope *) { return 0; }
-    virtual Value *codegen();
-};
+    /* Whether a label is defined in the subtree, so that it can be
+       reached by a goto. */
+    virtual bool definesLabels() const { return false; }
 
-class SymbolExprAST : public ExprAST {
-    sym_t m_sym;
-    enum SymType m_type;
-public:
-    SymbolExprAST(sym_t sym, enum SymType type) : ExprAST(), m_sym(sym), m_type(type) {}
-    SymbolExprAST(sym_t sym) : ExprAST(), m_sym(sym), m_type(Var) {}
-    virtual string toString(int level) const;
-    virtual vector<Symbol> collectDefinedSymbols();
-    virtual int checkSymbols(Scope *scope);
-    virtual Value *codegen();
-};
+    /* Whether the statement never continues with the next one. */
+    virtual bool jumps() const { return false; }
 
-class AddrExprAST : public ExprAST {
-    sym_t m_sym;
-    enum SymType m_type;
-public:
-    AddrExprAST(sym_t sym, enum SymType type) : ExprAST(), m_sym(sym), m_type(type) {}
-    AddrExprAST(sym_t sym) : ExprAST(), m_sym(sym), m_type(Var) {}
-    virtual string toString(int level) const;
-    virtual vector<Symbol> collectDefinedSymbols();
-    virtual int checkSymbols(Scope *scope);
-    virtual Value *codegen();
+    /* Generates LLVM IR code. */
+    virtual Value *codegen() = 0;
+
+    /* Appends bytecode which evaluates the subtree to b. Returns the
+       register holding the value, or -1 for statements. The value is
+       computed into dst if possible, unless that is -1. */
+    virtual int bytecode(BytecodeBuilder &b, int dst) const = 0;
+
+    /* Gives the variables of all scopes nested in the subtree their
+       registers. Done for a whole function before its code, so that no
+       variable ends up above the arguments of a call, where the callee
+       would overwrite it. */
+    virtual void bytecodeDeclare(BytecodeBuilder &) const {}
 };
 
+/* Collects the elements of a list while parsing. Lists live in astArena
+   along with their contiguous element buffer; a node takes the elements
+   over with take(), which swaps the buffer instead of copying it. */
 template <class T>
 class UnionList {
 public:
+    typedef vector<T, ArenaAllocator<T> > Vector;
+
     static UnionList<T> *push_back(UnionList<T> *l, T e) {
         if (l == NULL) {
             l = new UnionList<T>;
@@ -127,107 +348,402 @@ public:
         return l;
     }
 
-    static UnionList<T> *push_front(UnionList<T> *l, T e) {
-        if (l == NULL) {
-            l = new UnionList<T>;
-        }
-        l->m_v.push_front(e);
-        return l;
+    /* Leaves the list empty. */
+    void take(Vector &v) {
+        v.swap(m_v);
     }
 
-    vector<T> get() const {
-        return vector<T>(m_v.begin(), m_v.end());
-    }
+    static void *operator new(size_t n) { return astArena->allocate(n); }
+    static void operator delete(void *) {}
 private:
     UnionList() {}
-    list<T> m_v;
+    UnionList(const UnionList &);
+    UnionList &operator=(const UnionList &);
+    Vector m_v;
 };
 
 typedef UnionList<sym_t> SymList;
 typedef UnionList<ExprAST *> ExprList;
 
+/* Index of an expression in its ExprPool. */
+typedef unsigned int expr_t;
+
+#define EXPR_NONE ((expr_t)-1)
+
+enum ExprKind {
+    ExprNumber,     /* constant a */
+    ExprSymbol,     /* variable a of type op, used in line b */
+    ExprAddr,       /* address of symbol a of type op, used in line b */
+    ExprUnary,      /* op a; one of: NOT, UNARYMINUS, DEREF */
+    ExprBinary,     /* a op b; one of: '*', '+', AND, OPLESSEQ, '#' */
+    ExprCall,       /* function a, arguments b */
+    ExprDead        /* left over by fold() */
+};
+
+typedef UnionList<expr_t> ArgList;
+
+/* The expressions of one function, kept in parallel arrays instead of a
+   tree of nodes. The parser appends every expression after its operands,
+   so the expression e and everything below it take up the contiguous
+   range from first(e) to e, in the order the operands are evaluated. The
+   passes below walk that range front to back instead of following
+   pointers. Constants and argument lists live in tables of their own,
+   which a and b index. */
+class ExprPool {
+    typedef vector<unsigned char, ArenaAllocator<unsigned char> > KindVector;
+    typedef vector<int, ArenaAllocator<int> > OpVector;
+    typedef vector<expr_t, ArenaAllocator<expr_t> > IndexVector;
+    typedef vector<long, ArenaAllocator<long> > ConstVector;
+    KindVector m_kind;
+    OpVector m_op;
+    IndexVector m_a;
+    IndexVector m_b;
+    ConstVector m_consts;
+    /* The count of every argument list, followed by its arguments. */
+    IndexVector m_args;
+
+    ExprPool(const ExprPool &);
+    ExprPool &operator=(const ExprPool &);
+
+    expr_t add(enum ExprKind kind, int op, expr_t a, expr_t b);
+    void kill(expr_t e) { m_kind[e] = ExprDead; }
+    void copy(expr_t to, expr_t from);
+public:
+    ExprPool() {}
+    static void *operator new(size_t n) { return astArena->allocate(n); }
+    static void operator delete(void *) {}
+
+    expr_t number(long val);
+    expr_t symbol(sym_t s, int line);
+    expr_t addr(sym_t s, enum SymType t, int line);
+    expr_t unary(op_t op, expr_t arg);
+    expr_t binary(op_t op, expr_t lhs, expr_t rhs);
+    /* Takes the arguments over from args, which may be NULL. */
+    expr_t call(sym_t callee, ArgList *args);
+
+    enum ExprKind kind(expr_t e) const { return (enum ExprKind)m_kind[e]; }
+    op_t op(expr_t e) const { return m_op[e]; }
+    expr_t lhs(expr_t e) const { return m_a[e]; }
+    expr_t rhs(expr_t e) const { return m_b[e]; }
+    long value(expr_t e) const { return m_consts[m_a[e]]; }
+    sym_t sym(expr_t e) const { return m_a[e]; }
+    enum SymType type(expr_t e) const { return (enum SymType)m_op[e]; }
+    int line(expr_t e) const { return m_b[e]; }
+    unsigned int argCount(expr_t e) const { return m_args[m_b[e]]; }
+    expr_t arg(expr_t e, unsigned int i) const { return m_args[m_b[e] + 1 + i]; }
+
+    /* The first entry of the range of e. */
+    expr_t first(expr_t e) const;
+
+    /* Returns true and sets val if e is a number. */
+    bool constantValue(expr_t e, long &val) const;
+
+    /* Same as ExprAST::dump() for the expression e. */
+    void dump(expr_t e, AstDumper &d) const;
+
+    /* Reports every undefined symbol used by e. Returns the number of
+       errors. */
+    int checkSymbols(expr_t e, Scope *scope) const;
+
+    /* Same as ExprAST::collectAddressTaken() for the expression e. */
+    void collectAddressTaken(expr_t e, set<sym_t> &vars) const;
+
+    /* Simplifies the checked expression e in place, so that references
+       to it stay valid. Entries no longer needed are marked ExprDead.
+       Nothing is allocated, so worker threads may fold the functions of
+       the parser's arena. */
+    void fold(expr_t e);
+};
+
+/* The pool of the function currently being walked by this thread. */
+extern __thread ExprPool *exprPool;
+
+/* Makes p the current pool until the end of the block. */
+class UsePool {
+    ExprPool *m_saved;
+public:
+    UsePool(ExprPool *p) : m_saved(exprPool) { exprPool = p; }
+    ~UsePool() { exprPool = m_saved; }
+};
+
 class FunctionExprAST : public ExprAST {
 public:
-    FunctionExprAST(sym_t name, SymList *pars, ExprList *stats);
-    virtual ~FunctionExprAST();
-    virtual string toString(int level) const;
+    /* Takes over exprs, the pool of all expressions in stats. */
+    FunctionExprAST(sym_t name, SymList *pars, ExprList *stats, ExprPool *exprs, int line);
+    virtual void dump(AstDumper &d) const;
     virtual vector<Symbol> collectDefinedSymbols();
     virtual int checkSymbols(Scope *scope);
+    virtual void collectAddressTaken(set<sym_t> &vars) const;
+    virtual ExprAST *fold();
     virtual Value *codegen();
+    virtual int bytecode(BytecodeBuilder &b, int dst) const;
 protected:
     sym_t m_name;
-    vector<sym_t> m_pars;
-    vector<ExprAST *> m_stats;
+    SymVector m_pars;
+    ExprVector m_stats;
+    ExprPool *m_exprs;
+    int m_line;
+    Scope *m_scope;
 };
 
+/* A labelled statement. Statements without labels appear in lists
+   directly. */
 class StatementExprAST : public ExprAST {
-    vector<sym_t> m_labels;
+    SymVector m_labels;
     ExprAST *m_stat;
+    int m_line;
 public:
-    StatementExprAST(ExprAST *stat) : ExprAST(),  m_stat(stat) {}
-    StatementExprAST(SymList *labels, ExprAST *stat)
-        : ExprAST(), m_labels(labels->get()), m_stat(stat) { delete labels; }
-    virtual ~StatementExprAST();
-    virtual string toString(int level) const;
+    StatementExprAST(SymList *labels, ExprAST *stat, int line);
+    virtual void dump(AstDumper &d) const;
     virtual vector<Symbol> collectDefinedSymbols();
     virtual int checkSymbols(Scope *scope) { return m_stat->checkSymbols(scope); }
+    virtual void collectAddressTaken(set<sym_t> &vars) const;
+    virtual ExprAST *fold();
+    virtual bool definesLabels() const { return !m_labels.empty() || m_stat->definesLabels(); }
+    virtual bool jumps() const { return m_stat->jumps(); }
     virtual Value *codegen();
+    virtual int bytecode(BytecodeBuilder &b, int dst) const;
+    virtual void bytecodeDeclare(BytecodeBuilder &b) const { m_stat->bytecodeDeclare(b); }
 };
 
-class CallExprAST : public ExprAST {
-    sym_t m_callee;
-    vector<ExprAST *> m_args;
+/* A statement without a scope. op is one of: VAR, '=', RETURN, GOTO, or 0
+   for an expression whose value is not used. */
+class SimpleExprAST : public ExprAST {
+    op_t m_op;
+    expr_t m_lhs, m_rhs;
 public:
-    CallExprAST(sym_t callee, ExprList *args);
-    virtual ~CallExprAST();
-    virtual string toString(int level) const;
-    virtual vector<Symbol> collectDefinedSymbols() { return vector<Symbol>(); }
+    SimpleExprAST(op_t op, expr_t lhs, expr_t rhs = EXPR_NONE)
+        : ExprAST(), m_op(op), m_lhs(lhs), m_rhs(rhs) {}
+    virtual void dump(AstDumper &d) const;
+    virtual vector<Symbol> collectDefinedSymbols();
     virtual int checkSymbols(Scope *scope);
+    virtual void collectAddressTaken(set<sym_t> &vars) const;
+    virtual ExprAST *fold();
+    virtual bool jumps() const;
     virtual Value *codegen();
+    virtual int bytecode(BytecodeBuilder &b, int dst) const;
 };
 
 class IfExprAST : public ExprAST {
-    ExprAST *m_cond;
-    vector<ExprAST *> m_then;
+    expr_t m_cond;
+    ExprVector m_then;
+    Scope *m_scope;
 public:
-    IfExprAST(ExprAST *cond, ExprList *then);
-    virtual ~IfExprAST();
-    virtual string toString(int level) const;
+    IfExprAST(expr_t cond, ExprList *then);
+    virtual void dump(AstDumper &d) const;
     virtual vector<Symbol> collectDefinedSymbols();
     virtual int checkSymbols(Scope *scope);
+    virtual void collectAddressTaken(set<sym_t> &vars) const;
+    /* An if whose condition is false is left out, unless a label in it
+       can still be reached. One whose condition is true stays, as its
+       statements have a scope of their own, but does not branch. */
+    virtual ExprAST *fold();
+    virtual bool definesLabels() const;
     virtual Value *codegen();
+    virtual int bytecode(BytecodeBuilder &b, int dst) const;
+    virtual void bytecodeDeclare(BytecodeBuilder &b) const;
+};
+
+/* Interns identifiers. Names are copied back to back into large chunks
+   which are never moved, so pointers returned by get() stay valid for the
+   lifetime of the table. Lookup goes through an open addressing hash table
+   of symbol indices. */
+class SymbolTable {
+    struct Entry {
+        const char *name;
+        size_t len;
+        unsigned int hash;
+    };
+    vector<Entry> m_symbols;
+    vector<sym_t> m_buckets;
+    vector<char *> m_chunks;
+    char *m_pos;
+    size_t m_free;
+
+    SymbolTable(const SymbolTable &);
+    SymbolTable &operator=(const SymbolTable &);
+
+    static unsigned int hash(const char *s, size_t len);
+    const char *store(const char *s, size_t len);
+    void rehash();
+public:
+    SymbolTable();
+    ~SymbolTable();
+    sym_t insert(const char *s, size_t len);
+    const char *get(sym_t i) const;
+    size_t size() const { return m_symbols.size(); }
+    string toString() const;
 };
 
-class BinaryExprAST : public ExprAST {
-    op_t m_op;  /* one of: VAR, '=', '*', '+', AND, OPLESSEQ, '#' */
-    ExprAST *m_lhs, *m_rhs;
+/* The contents of one source file. Regular files are mapped, anything
+   else (such as a pipe on stdin) is read into memory. */
+class SourceFile {
+    char *m_data;
+    size_t m_size;
+    bool m_mapped;
+
+    SourceFile(const SourceFile &);
+    SourceFile &operator=(const SourceFile &);
 public:
-    BinaryExprAST(op_t op, ExprAST *lhs, ExprAST *rhs)
-        : ExprAST(), m_op(op), m_lhs(lhs), m_rhs(rhs) {}
-    virtual ~BinaryExprAST();
-    virtual string toString(int level) const;
-    virtual vector<Symbol> collectDefinedSymbols();
-    virtual int checkSymbols(Scope *scope);
-    virtual Value *codegen();
+    SourceFile() : m_data(NULL), m_size(0), m_mapped(false) {}
+    ~SourceFile();
+    /* Reads stdin if path is NULL. Returns nonzero on failure. */
+    int open(const char *path);
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
 };
 
-class UnaryExprAST : public ExprAST {
-    op_t m_op; /* one of: NOT, UNARYMINUS, DEREF, RETURN, GOTO  */
-    ExprAST *m_arg;
+/* A token refers to its text in the scanned buffer. */
+struct Token {
+    int type;
+    const char *text;
+    size_t len;
+    int line;
+    long val;
+    sym_t sym;
+};
+
+/* Tokens scanned at a time by Lexer::nextBatch(). */
+#define LEX_BATCH 64
+
+/* Scanner over a buffer in memory. All state lives in the object, so
+   any number of buffers can be scanned at the same time. */
+class Lexer {
+    const char *m_pos;
+    const char *m_end;
+    int m_line;
+    Token m_batch[LEX_BATCH];
+    int m_batched;
+    int m_taken;
 public:
-    UnaryExprAST(op_t op, ExprAST *arg)
-        : ExprAST(), m_op(op), m_arg(arg) {}
-    virtual ~UnaryExprAST();
-    virtual string toString(int level) const;
-    virtual vector<Symbol> collectDefinedSymbols() { return vector<Symbol>(); }
-    virtual int checkSymbols(Scope *scope) { return m_arg->checkSymbols(scope); }
-    virtual Value *codegen();
+    Lexer(const char *buf, size_t len) : m_pos(buf), m_end(buf + len), m_line(1), m_batched(0), m_taken(0) {}
+    /* For a part of a file which starts in line. */
+    Lexer(const char *buf, size_t len, int line) : m_pos(buf), m_end(buf + len), m_line(line), m_batched(0), m_taken(0) {}
+    /* Fills in t and returns its type, or 0 at the end of the input.
+       Returns -1 for an invalid character, which is skipped. */
+    int next(Token &t);
+    /* Same, but scans LEX_BATCH tokens ahead at a time and charges them
+       to PhaseScan in one go. Reading the clock for every token would
+       cost more than scanning it. */
+    int nextBatch(Token &t);
 };
 
-class SymbolTable {
-    vector<string> m_symbols;
+/* Source text of a single function definition, including its ';'. */
+struct SourceRange {
+    const char *text;
+    size_t len;
+    int line;
+};
+
+/* Finds the function definitions in buf, which starts in line, by
+   matching every END of a definition to its IF without parsing.
+   Definitions are expected to end with END ';'; text which does not
+   fit is included in the next definition, or in one of its own at the
+   end, for the parser to report. */
+void splitFunctions(const char *buf, size_t len, int line, vector<SourceRange> &fns);
+
+struct CodegenContext;
+struct ScopeMarks;
+
+/* Settings shared by all translation units of a run. */
+struct CompileOptions {
+    /* Threads used for code generation and emission of one unit. */
+    int jobs;
+    /* Threads used for emission only, by default jobs. */
+    int emitJobs;
+    /* Emit every function as soon as it has been parsed. */
+    int streaming;
+    /* Print checked trees instead of compiling them. */
+    enum DumpFormat dump;
+    /* Generated functions are looked up and stored here, if set. */
+    FunctionCache *cache;
+    /* If set, this function is called with runArgs instead of printing
+       assembly. */
+    const char *run;
+    vector<long> runArgs;
+    /* Run in the bytecode interpreter instead of the JIT. */
+    int interpret;
+    /* With interpret, compile hot functions to native code. */
+    int tiered;
+    /* If not empty, the module is optimized as a whole program and
+       only these functions stay visible outside of it. */
+    vector<string> exports;
+    /* How errors are printed, and how many are reported before giving
+       up (0 for no limit). */
+    enum DiagFormat diagFormat;
+    int errorLimit;
+    /* Reuse the assembly of unchanged functions from the previous run. */
+    int incremental;
+    /* Write object files instead of assembly. */
+    int object;
+};
+
+/* Everything needed to compile one translation unit: its symbol table,
+   AST arena, LLVM context and module. Sessions share no state, so any
+   number of them can compile on different threads at the same time.
+   While a session compiles, it is the current session of its thread
+   and syms, astArena and the code generator refer to its state. */
+class CompilerSession {
+    CompilerSession(const CompilerSession &);
+    CompilerSession &operator=(const CompilerSession &);
 public:
-    sym_t insert(string s);
-    string get(sym_t i) const;
-    string toString() const;
+    /* path names the source in error messages, NULL for stdin. */
+    CompilerSession(const CompileOptions &opts, FILE *out, const char *path);
+    ~CompilerSession();
+
+    /* Compiles the program in buf and writes the result to out. Errors
+       are printed to stderr once the whole program has been checked.
+       Returns 0 or the ERR_* code of the first error. */
+    int compile(const char *buf, size_t len);
+
+    /* Same for opts.incremental. Functions found in old are copied from
+       there, only the others are parsed and compiled. Where the assembly
+       of each function ends up in out is recorded in index. As with
+       opts.streaming, every function is optimized on its own. */
+    int compileIncremental(const char *buf, size_t len, const AsmIndex &old,
+                           AsmIndex &index);
+
+    /* Makes this the current session of the calling thread. */
+    void activate();
+    void deactivate();
+
+    /* Records err unless an earlier error has been recorded. */
+    void fail(int err) {
+        if (m_err == 0) {
+            m_err = err;
+        }
+    }
+    int error() const { return m_err; }
+
+    const CompileOptions &opts;
+    FILE *out;
+    LLVMContext context;
+    Module *module;
+    SymbolTable symbols;
+    Arena arena;
+    CodegenContext *cg;
+    ScopeMarks *marks;
+    Lexer *lexer;
+    Diagnostics *diags;
+    /* Errors reported up to the end of the last function parsed. */
+    int reported;
+    /* Expressions of the function being parsed, set up on first use. */
+    ExprPool *exprs;
+
+    /* Functions left for codegenParallel(). */
+    vector<ExprAST *> pending;
+
+    /* Functions translated for the interpreter, with opts.interpret. */
+    BytecodeProgram *bytecode;
+    /* Runs the hot functions of bytecode, with opts.tiered. */
+    ExecutionEngine *jit;
+
+    /* Kept across streamAsm() calls. */
+    raw_ostream *asmOut;
+    TargetMachine *target;
+    FunctionPassManager *asmPasses;
+    formatted_raw_ostream *asmStream;
+
+private:
+    int m_err;
 };
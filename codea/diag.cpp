@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "diag.hpp"
+
+using std::string;
+using std::vector;
+
+__thread Diagnostics *diags = NULL;
+
+Diagnostics::Diagnostics(const char *file, enum DiagFormat format, int limit)
+    : m_file(file), m_format(format), m_limit(limit) {
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+Diagnostics::~Diagnostics() {
+    pthread_mutex_destroy(&m_lock);
+}
+
+void Diagnostics::error(int code, int line, const char *fmt, ...) {
+    char buf[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    pthread_mutex_lock(&m_lock);
+    if (m_limit == 0 || (int)m_entries.size() < m_limit) {
+        Entry e;
+        e.line = line;
+        e.code = code;
+        e.msg = buf;
+        m_entries.push_back(e);
+    }
+    pthread_mutex_unlock(&m_lock);
+}
+
+int Diagnostics::count() {
+    pthread_mutex_lock(&m_lock);
+    int n = m_entries.size();
+    pthread_mutex_unlock(&m_lock);
+    return n;
+}
+
+bool Diagnostics::full() {
+    return m_limit != 0 && count() >= m_limit;
+}
+
+int Diagnostics::firstCode() {
+    pthread_mutex_lock(&m_lock);
+    int code = 0;
+    int line = 0;
+    for (unsigned int i = 0; i < m_entries.size(); i++) {
+        if (code == 0 || m_entries[i].line < line) {
+            code = m_entries[i].code;
+            line = m_entries[i].line;
+        }
+    }
+    pthread_mutex_unlock(&m_lock);
+    return code;
+}
+
+struct ByLine {
+    template <class E>
+    bool operator()(const E &a, const E &b) const { return a.line < b.line; }
+};
+
+static void printJsonString(FILE *out, const char *s) {
+    putc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            putc(c, out);
+        }
+    }
+    putc('"', out);
+}
+
+void Diagnostics::flush(FILE *out) {
+    pthread_mutex_lock(&m_lock);
+    /* Errors of one line stay in the order they were found in. */
+    std::stable_sort(m_entries.begin(), m_entries.end(), ByLine());
+    for (unsigned int i = 0; i < m_entries.size(); i++) {
+        const Entry &e = m_entries[i];
+        if (m_format == DiagJson) {
+            fprintf(out, "{\"file\": ");
+            if (m_file != NULL) {
+                printJsonString(out, m_file);
+            } else {
+                fprintf(out, "null");
+            }
+            fprintf(out, ", \"line\": %d, \"code\": %d, \"message\": ", e.line, e.code);
+            printJsonString(out, e.msg.c_str());
+            fprintf(out, "}\n");
+        } else {
+            if (m_file != NULL) {
+                fprintf(out, "%s: ", m_file);
+            }
+            fprintf(out, "ERROR line %d: %s\n", e.line, e.msg.c_str());
+        }
+    }
+    if (m_limit != 0 && (int)m_entries.size() >= m_limit && m_format == DiagText) {
+        fprintf(out, "%s%stoo many errors, stopping\n",
+                m_file != NULL ? m_file : "", m_file != NULL ? ": " : "");
+    }
+    pthread_mutex_unlock(&m_lock);
+}
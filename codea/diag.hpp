@@ -0,0 +1,57 @@
+/* Errors of one translation unit. Instead of stopping at the first error,
+   the compiler records every error together with its line and goes on
+   checking the rest of the program. Errors may be reported from several
+   threads; flush() prints them in source order. */
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+enum DiagFormat {
+    /* ERROR line 3: message */
+    DiagText,
+    /* One JSON object per line */
+    DiagJson
+};
+
+/* Used if --error-limit is not given. */
+#define ERROR_LIMIT 20
+
+class Diagnostics {
+    struct Entry {
+        int line;
+        int code;
+        std::string msg;
+    };
+    const char *m_file;
+    enum DiagFormat m_format;
+    int m_limit;
+    std::vector<Entry> m_entries;
+    pthread_mutex_t m_lock;
+
+    Diagnostics(const Diagnostics &);
+    Diagnostics &operator=(const Diagnostics &);
+public:
+    /* file is NULL for stdin. With a limit of 0, errors are unlimited. */
+    Diagnostics(const char *file, enum DiagFormat format, int limit);
+    ~Diagnostics();
+
+    /* Records an error in line. code is the ERR_* exit code it implies.
+       Errors beyond the limit are dropped. */
+    void error(int code, int line, const char *fmt, ...)
+        __attribute__((format(printf, 4, 5)));
+
+    int count();
+    /* Whether the limit has been reached, in which case compilation
+       should stop. */
+    bool full();
+    /* The code of the first error in source order, or 0. */
+    int firstCode();
+
+    /* Prints all errors to out, sorted by line. */
+    void flush(FILE *out);
+};
+
+/* The diagnostics of the session running on the current thread. */
+extern __thread Diagnostics *diags;
@@ -2,29 +2,47 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <llvm/Support/Threading.h>
 
 #include "common.hpp"
+#include "server.hpp"
+#include "cache.hpp"
+#include "interp.hpp"
+#include "incremental.hpp"
 
 #define YYDEBUG 1
 
-int yylex();
-void yyerror(const char *p);
-void process_funcdef(ExprAST *n);
-
-int errcount = 0;
-
 %}
 
 %locations
+%define api.pure
+%parse-param {CompilerSession *session}
+%lex-param {CompilerSession *session}
 
 %union {
     int sym;
     long val;
     ExprAST *n;
+    expr_t e;
     SymList *syms;
     ExprList *exprs;
+    ArgList *args;
 }
 
+%{
+
+int yylex(YYSTYPE *lval, YYLTYPE *lloc, CompilerSession *session);
+void yyerror(YYLTYPE *lloc, CompilerSession *session, const char *p);
+static int process_funcdef(CompilerSession *session, ExprAST *n);
+static int skip_error(CompilerSession *session);
+static ExprPool *pool(CompilerSession *session);
+static ExprPool *takePool(CompilerSession *session);
+
+%}
+
 %start program
 
 %token IDENT NUM END RETURN GOTO IF THEN VAR
@@ -38,17 +56,24 @@ int errcount = 0;
 
 program     :   /* empty */
             |   program funcdef ';'
-                    { process_funcdef($<n>2); }
+                    { if (process_funcdef(session, $<n>2) != 0) YYABORT; }
+            |   program error ';'
+                    { if (skip_error(session) != 0) YYABORT; }
             ;
 funcdef     :   IDENT '(' pars ')' stats END
-                    { $<n>$ = new FunctionExprAST($<sym>1, $<syms>3, $<exprs>5); }
+                    { $<n>$ = new FunctionExprAST($<sym>1, $<syms>3, $<exprs>5, takePool(session), @1.first_line); }
+            |   IDENT '(' error ')' stats END
+                    { $<n>$ = new FunctionExprAST($<sym>1, NULL, $<exprs>5, takePool(session), @1.first_line); }
             ;
 pars        :   /* empty */
                     { $<syms>$ = NULL; }
-            |   IDENT
-                    { $<syms>$ = SymList::push_front(NULL, $<sym>1); }
-            |   IDENT ','  pars
-                    { $<syms>$ = SymList::push_front($<syms>3, $<sym>1); }
+            |   parlist
+            |   parlist ','
+            ;
+parlist     :   IDENT
+                    { $<syms>$ = SymList::push_back(NULL, $<sym>1); }
+            |   parlist ',' IDENT
+                    { $<syms>$ = SymList::push_back($<syms>1, $<sym>3); }
             ;
 stats       :   /* empty */
                     { $<exprs>$ = NULL; }
@@ -58,9 +83,9 @@ stats       :   /* empty */
                     { $<exprs>$ = $<exprs>1; }
             ;
 singlestat  :   stat
-                    { $<n>$ = new StatementExprAST($<n>1); }
+                    { $<n>$ = $<n>1; }
             |   labels stat
-                    { $<n>$ = new StatementExprAST($<syms>1, $<n>2); }
+                    { $<n>$ = new StatementExprAST($<syms>1, $<n>2, @1.first_line); }
             ;
 labels      :   IDENT ':'
                     { $<syms>$ = SymList::push_back(NULL, $<sym>1); }
@@ -68,118 +93,719 @@ labels      :   IDENT ':'
                     { $<syms>$ = SymList::push_back($<syms>1, $<sym>2); }
             ;
 stat        :   RETURN expr
-                    { $<n>$ = new UnaryExprAST(RETURN, $<n>2); }
+                    { $<n>$ = new SimpleExprAST(RETURN, $<e>2); }
             |   GOTO IDENT
-                    { $<n>$ = new UnaryExprAST(GOTO, new AddrExprAST($<sym>2, Label)); }
+                    { $<n>$ = new SimpleExprAST(GOTO, pool(session)->addr($<sym>2, Label, @2.first_line)); }
             |   IF expr THEN stats END
-                    { $<n>$ = new IfExprAST($<n>2, $<exprs>4); }
+                    { $<n>$ = new IfExprAST($<e>2, $<exprs>4); }
             |   VAR IDENT '=' expr
-                    { $<n>$ = new BinaryExprAST(VAR, new AddrExprAST($<sym>2), $<n>4); }
+                    { $<n>$ = new SimpleExprAST(VAR, pool(session)->addr($<sym>2, Var, @2.first_line), $<e>4); }
             |   lexpr '=' expr
-                    { $<n>$ = new BinaryExprAST('=', $<n>1, $<n>3); }
+                    { $<n>$ = new SimpleExprAST('=', $<e>1, $<e>3); }
             |   term
+                    { $<n>$ = new SimpleExprAST(0, $<e>1); }
             ;
 lexpr       :   IDENT
-                    { $<n>$ = new AddrExprAST($<sym>1); }
+                    { $<e>$ = pool(session)->addr($<sym>1, Var, @1.first_line); }
             |   '*' unary
-                    { $<n>$ = $<n>2; }
+                    { $<e>$ = $<e>2; }
             ;
 termmul     :   term
             |   termmul '*' term
-                    { $<n>$ = new BinaryExprAST('*', $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary('*', $<e>1, $<e>3); }
             ;
 termplus    :   term
             |   termplus '+' term
-                    { $<n>$ = new BinaryExprAST('+', $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary('+', $<e>1, $<e>3); }
             ;
 termand     :   term
             |   termand AND term
-                    { $<n>$ = new BinaryExprAST(AND, $<n>2, $<n>3); }
+                    { $<e>$ = pool(session)->binary(AND, $<e>1, $<e>3); }
             ;
 expr        :   unary
             |   termmul '*' term
-                    { $<n>$ = new BinaryExprAST('*', $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary('*', $<e>1, $<e>3); }
             |   termplus '+' term
-                    { $<n>$ = new BinaryExprAST('+', $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary('+', $<e>1, $<e>3); }
             |   termand AND term
-                    { $<n>$ = new BinaryExprAST(AND, $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary(AND, $<e>1, $<e>3); }
             |   term OPLESSEQ term
-                    { $<n>$ = new BinaryExprAST(OPLESSEQ, $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary(OPLESSEQ, $<e>1, $<e>3); }
             |   term '#' term
-                    { $<n>$ = new BinaryExprAST('#', $<n>1, $<n>3); }
+                    { $<e>$ = pool(session)->binary('#', $<e>1, $<e>3); }
             ;
 unary       :   NOT unary
-                    { $<n>$ = new UnaryExprAST(NOT, $<n>2); }
+                    { $<e>$ = pool(session)->unary(NOT, $<e>2); }
             |   '-' unary
-                    { $<n>$ = new UnaryExprAST(UNARYMINUS, $<n>2); }
+                    { $<e>$ = pool(session)->unary(UNARYMINUS, $<e>2); }
             |   '*' unary
-                    { $<n>$ = new UnaryExprAST(DEREF, $<n>2); }
+                    { $<e>$ = pool(session)->unary(DEREF, $<e>2); }
             |   term
             ;
 args        :   /* empty */
-                    { $<exprs>$ = NULL; }
-            |   expr
-                    { $<exprs>$ = ExprList::push_front(NULL, $<n>1); }
-            |   expr ',' args
-                    { $<exprs>$ = ExprList::push_front($<exprs>3, $<n>1); }
+                    { $<args>$ = NULL; }
+            |   arglist
+            |   arglist ','
+            ;
+arglist     :   expr
+                    { $<args>$ = ArgList::push_back(NULL, $<e>1); }
+            |   arglist ',' expr
+                    { $<args>$ = ArgList::push_back($<args>1, $<e>3); }
             ;
 term        :   '(' expr ')'
-                    { $<n>$ = $<n>2; }
+                    { $<e>$ = $<e>2; }
             |   NUM
-                    { $<n>$ = new NumberExprAST($<val>1); }
+                    { $<e>$ = pool(session)->number($<val>1); }
             |   IDENT
-                    { $<n>$ = new SymbolExprAST($<sym>1); }
+                    { $<e>$ = pool(session)->symbol($<sym>1, @1.first_line); }
             |   IDENT '(' args ')'
-                    { $<n>$ = new CallExprAST($<sym>1, $<exprs>3); }
+                    { $<e>$ = pool(session)->call($<sym>1, $<args>3); }
             ;
 
 %%
 
-void process_funcdef(ExprAST *n) {
-    if (errcount > 0) {
-        delete n;
-        exit(ERR_SYNTAX);
+/* Checks and compiles a function right after it has been parsed, or
+   queues it if the session generates code on several threads. After the
+   first error, functions are only checked. Returns nonzero if parsing
+   has to stop. */
+static int process_funcdef(CompilerSession *session, ExprAST *n) {
+    const CompileOptions &opts = session->opts;
+    /* The tree of a function with a syntax error is incomplete, checking
+       it would only report follow-up errors. */
+    if (diags->count() != session->reported) {
+        return skip_error(session);
+    }
+    if (opts.dump != DumpNone) {
+        dumpAst(n, session->out, opts.dump);
+    }
+    if (opts.jobs > 1 && session->error() == 0) {
+        session->pending.push_back(n);
+        return 0;
+    }
+    if (checkFunction(n) != 0) {
+        session->fail(ERR_SCOPE);
+    }
+    session->reported = diags->count();
+    if (session->error() != 0) {
+        /* Queued functions and, with tiering, translated ones still
+           need their trees. */
+        if (session->pending.empty() && !opts.tiered) {
+            astArena->reset();
+        }
+        return diags->full();
+    }
+
+    if (opts.dump != DumpNone) {
+        astArena->reset();
+        return 0;
+    }
+
+    /* -O0 compiles the tree as written. */
+    if (optLevel > 0) {
+        n->fold();
+    }
+
+    if (opts.interpret) {
+        phaseBegin(PhaseCodegen);
+        session->bytecode->add(n);
+        phaseEnd();
+        /* Hot functions are compiled from their trees later on. */
+        if (!opts.tiered) {
+            astArena->reset();
+        }
+        return 0;
     }
-    n->collectDefinedSymbols();
-    int err = n->checkSymbols(NULL);
-    if (err) {
-        delete n;
-        exit(ERR_SCOPE);
+
+    if (opts.cache != NULL) {
+        if (codegenCached(session, n) != 0) {
+            session->fail(ERR_SCOPE);
+            return 1;
+        }
+    } else {
+        phaseBegin(PhaseCodegen);
+        Value *ret = n->codegen();
+        phaseEnd();
+        if (ret == 0) {
+            fprintf(stderr, "codegen() returned 0.\n");
+            session->fail(ERR_SCOPE);
+            return 1;
+        }
     }
 
-    string s = n->toString(0);
-    //printf("%s", s.c_str());
+    /* Releases the whole tree, including scopes. */
+    astArena->reset();
 
-    Value *ret = n->codegen();
-    if (ret == 0) {
-        fprintf(stderr, "codegen() returned 0.\n");
-        exit(ERR_SCOPE);
+    if (opts.streaming) {
+        streamAsm(session);
     }
+    return 0;
+}
 
-    delete n;
-    
-    if (err) {
-        exit(ERR_SCOPE);
+/* Called once the parser has recovered from a syntax error. Returns
+   nonzero if parsing has to stop. */
+static int skip_error(CompilerSession *session) {
+    /* Expressions of the broken function are left in the arena. */
+    session->exprs = NULL;
+    session->reported = diags->count();
+    return diags->full();
+}
+
+/* The pool the expressions of the function being parsed go to. */
+static ExprPool *pool(CompilerSession *session) {
+    if (session->exprs == NULL) {
+        session->exprs = new ExprPool;
     }
+    return session->exprs;
 }
 
-void yyerror(const char *p) {
-    fprintf(stderr, "ERROR line %d: %s\n", yylloc.first_line, p);
-    errcount++;
+/* Hands the pool over to the function which has just been parsed. */
+static ExprPool *takePool(CompilerSession *session) {
+    ExprPool *p = pool(session);
+    session->exprs = NULL;
+    return p;
 }
 
-int main(void) {
-    yydebug = 0;
+void yyerror(YYLTYPE *lloc, CompilerSession *session, const char *p) {
+    diags->error(ERR_SYNTAX, lloc->first_line, "%s", p);
+    session->fail(ERR_SYNTAX);
+}
+
+int CompilerSession::compile(const char *buf, size_t len) {
+    activate();
+    unsigned long nodes = astNodes;
+
+    Lexer l(buf, len);
+    lexer = &l;
+    phaseBegin(PhaseParse);
+    yyparse(this);
+    phaseEnd();
+    lexer = NULL;
+    if (opts.streaming) {
+        finishAsm(this);
+    }
+
+    /* Queued functions are checked even after an error. */
+    if (!pending.empty()) {
+        fail(codegenParallel(this, opts.jobs));
+    }
+
+    /* As before, functions compiled up to a syntax error are still
+       printed. */
+    if (m_err == 0 || m_err == ERR_SYNTAX) {
+        if (opts.run != NULL) {
+            /* Only complete programs are run. */
+            if (m_err == 0) {
+                fail(opts.interpret ? runBytecode(this) : runModule(this));
+            }
+        } else if (!opts.streaming && opts.dump == DumpNone) {
+            printAsm(this, opts.emitJobs);
+        }
+    }
+    fflush(out);
+
+    /* Functions checked on several threads may have failed out of
+       order. */
+    if (diags->count() != 0) {
+        m_err = diags->firstCode();
+        diags->flush(stderr);
+    }
+
+    countUnit(astNodes - nodes, symbols.size());
+    deactivate();
+    return m_err;
+}
+
+int CompilerSession::compileIncremental(const char *buf, size_t len, const AsmIndex &old,
+                                        AsmIndex &index) {
+    activate();
+    unsigned long nodes = astNodes;
+
+    vector<SourceRange> fns;
+    phaseBegin(PhaseScan);
+    splitFunctions(buf, len, 1, fns);
+    phaseEnd();
+
+    string text;
+    for (unsigned int i = 0; i < fns.size() && !diags->full(); i++) {
+        string key = sourceKey(fns[i].text, fns[i].len);
+        const char *p;
+        size_t n;
+        if (!old.lookup(key, p, n)) {
+            /* Every definition is parsed on its own. */
+            Lexer l(fns[i].text, fns[i].len, fns[i].line);
+            lexer = &l;
+            phaseBegin(PhaseParse);
+            yyparse(this);
+            phaseEnd();
+            lexer = NULL;
+
+            text.clear();
+            if (m_err == 0) {
+                emitFunctionAsm(this, text);
+            }
+            p = text.data();
+            n = text.size();
+        }
+        /* After an error, the remaining definitions are only checked. */
+        if (m_err == 0) {
+            fwrite(p, 1, n, out);
+            index.add(key, n);
+        }
+    }
+    fflush(out);
+
+    if (diags->count() != 0) {
+        m_err = diags->firstCode();
+        diags->flush(stderr);
+    }
+
+    countUnit(astNodes - nodes, symbols.size());
+    deactivate();
+    return m_err;
+}
+
+/* Compiles path incrementally into outPath. The new assembly is written
+   next to it and only renamed into place once it is complete, so after
+   an error, the previous assembly and its index stay usable. */
+static int compileUnitIncremental(const CompileOptions &opts, const char *path,
+                                  const SourceFile &f, const string &outPath) {
+    AsmIndex old, index;
+    old.load(outPath);
+
+    string tmpPath = outPath + ".tmp";
+    FILE *out = fopen(tmpPath.c_str(), "w");
+    if (out == NULL) {
+        perror(tmpPath.c_str());
+        return EXIT_FAILURE;
+    }
+    int err;
+    {
+        CompilerSession session(opts, out, path);
+        err = session.compileIncremental(f.data(), f.size(), old, index);
+    }
+    if (fclose(out) != 0 && err == 0) {
+        perror(tmpPath.c_str());
+        err = EXIT_FAILURE;
+    }
+    if (err != 0) {
+        unlink(tmpPath.c_str());
+        return err;
+    }
+
+    /* Without an index, the next run starts over, which is always safe. */
+    AsmIndex::remove(outPath);
+    if (rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+        perror(outPath.c_str());
+        unlink(tmpPath.c_str());
+        return EXIT_FAILURE;
+    }
+    if (index.save(outPath) != 0) {
+        perror(outPath.c_str());
+    }
+    return 0;
+}
+
+/* Compiles path into a file named like it with the extension replaced
+   by .s, or .o for object files. Returns 0 or the error code of the
+   unit. */
+static int compileUnit(const CompileOptions &opts, const char *path) {
+    SourceFile f;
+    if (f.open(path) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    string outPath(path);
+    size_t dot = outPath.rfind('.');
+    if (dot != string::npos && outPath.find('/', dot) == string::npos) {
+        outPath.erase(dot);
+    }
+    const char *ext = (opts.object ? ".o" : ".s");
+    outPath += ext;
+    if (outPath == path) {
+        outPath += ext;
+    }
+    if (opts.incremental) {
+        return compileUnitIncremental(opts, path, f, outPath);
+    }
+
+    FILE *out = fopen(outPath.c_str(), "w");
+    if (out == NULL) {
+        perror(outPath.c_str());
+        return EXIT_FAILURE;
+    }
+    int err;
+    {
+        CompilerSession session(opts, out, path);
+        err = session.compile(f.data(), f.size());
+    }
+    fclose(out);
+    return err;
+}
 
-    yyparse();
+struct UnitQueue {
+    const CompileOptions *opts;
+    char **paths;
+    vector<int> results;
+    int next;
+};
 
-    //printf("%s", syms.toString().c_str());
-    printAsm();
-    delete theModule;
+static void *unitWorker(void *arg) {
+    UnitQueue *q = (UnitQueue *)arg;
+    int i;
+    while ((i = __sync_fetch_and_add(&q->next, 1)) < (int)q->results.size()) {
+        q->results[i] = compileUnit(*q->opts, q->paths[i]);
+    }
+    return NULL;
+}
 
-    if (errcount > 0) {
-        return ERR_SYNTAX;
+/* Compiles every path as a translation unit of its own on a pool of
+   nthreads threads. Returns the error code of the first failing unit
+   in argument order. */
+static int compileUnits(const CompileOptions &opts, char **paths, int n, int nthreads) {
+    UnitQueue q;
+    q.opts = &opts;
+    q.paths = paths;
+    q.results.resize(n, 0);
+    q.next = 0;
+
+    if (nthreads > n) {
+        nthreads = n;
+    }
+    if (nthreads > 1 && !llvm_is_multithreaded()) {
+        llvm_start_multithreaded();
+    }
+    vector<pthread_t> threads(nthreads);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, unitWorker, &q) != 0) {
+            perror("pthread_create");
+            exit(ERR_SCOPE);
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
     }
 
+    for (int i = 0; i < n; i++) {
+        if (q.results[i] != 0) {
+            return q.results[i];
+        }
+    }
     return 0;
 }
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-O level] [-c] [-s | -j jobs] [--emit-jobs=n] [--stats[=json]] "
+            "[--time-passes] [--dump-ast[=sexpr]]\n"
+            "       [--no-verbose-asm]\n"
+            "       [--cache=dir [--cache-size=MiB]] [--export=function[,function...]]\n"
+            "       [--diagnostics=text|json] [--error-limit=n] [--incremental]\n"
+            "       [--run=function[,arg...] | --interpret=function[,arg...] |\n"
+            "        --tiered=function[,arg...]] [file...]\n"
+            "       %s --server[=socket]\n"
+            "With several files, each is compiled on its own into a .s file,\n"
+            "on up to jobs threads. --emit-jobs only sets the threads for\n"
+            "emitting the assembly of a single file. --run calls function in a single file\n"
+            "with the given arguments and prints its result; --interpret\n"
+            "does the same without generating machine code, and --tiered\n"
+            "only generates machine code for hot functions. With --export,\n"
+            "the assembly is optimized as a whole program, and only the\n"
+            "functions given stay visible outside of it. Errors are printed\n"
+            "as text or as one JSON object per line; compilation stops after\n"
+            "n errors, or never with an error limit of 0. With --incremental,\n"
+            "each file is compiled into its .s file, and functions which did\n"
+            "not change since the last run are copied from there. -c writes\n"
+            "an object file instead of assembly, into a .o file for several\n"
+            "files. --no-verbose-asm leaves out the comments in assembly.\n", name, name);
+    exit(EXIT_FAILURE);
+}
+
+enum {
+    OptStats = 256,
+    OptTimePasses,
+    OptDumpAst,
+    OptServer,
+    OptCache,
+    OptCacheSize,
+    OptRun,
+    OptInterpret,
+    OptTiered,
+    OptExport,
+    OptDiagnostics,
+    OptErrorLimit,
+    OptIncremental,
+    OptNoVerboseAsm,
+    OptEmitJobs
+};
+
+/* Size limit of the function cache, unless given by --cache-size. */
+#define CACHE_SIZE_MB 256
+
+/* Set in the server and inherited by the children running requests. */
+static int serving = 0;
+
+static int run(int argc, char **argv) {
+    static const struct option longopts[] = {
+        { "stats", optional_argument, NULL, OptStats },
+        { "time-passes", no_argument, NULL, OptTimePasses },
+        { "dump-ast", optional_argument, NULL, OptDumpAst },
+        { "server", optional_argument, NULL, OptServer },
+        { "cache", required_argument, NULL, OptCache },
+        { "cache-size", required_argument, NULL, OptCacheSize },
+        { "run", required_argument, NULL, OptRun },
+        { "interpret", required_argument, NULL, OptInterpret },
+        { "tiered", required_argument, NULL, OptTiered },
+        { "export", required_argument, NULL, OptExport },
+        { "diagnostics", required_argument, NULL, OptDiagnostics },
+        { "error-limit", required_argument, NULL, OptErrorLimit },
+        { "incremental", no_argument, NULL, OptIncremental },
+        { "no-verbose-asm", no_argument, NULL, OptNoVerboseAsm },
+        { "emit-jobs", required_argument, NULL, OptEmitJobs },
+        { NULL, 0, NULL, 0 }
+    };
+    int stats = 0, statsJson = 0, timePasses = 0;
+    int jobs = 1, streaming = 0;
+    /* Same as jobs unless given. */
+    int emitJobs = 0;
+    enum DumpFormat dumpFormat = DumpNone;
+    const char *serverPath = NULL;
+    const char *cacheDir = NULL;
+    long cacheSize = CACHE_SIZE_MB;
+    string runEntry;
+    vector<long> runArgs;
+    int running = 0, interpret = 0, tiered = 0;
+    vector<string> exports;
+    enum DiagFormat diagFormat = DiagText;
+    int errorLimit = ERROR_LIMIT;
+    int incremental = 0;
+    int object = 0, verboseAsm = 1;
+
+    /* Fully restart option parsing and reset all settings which are
+       kept in globals. run() is called again for every request to the
+       server, in a child which inherits them from the server. */
+    optind = 0;
+    optLevel = OPT_LEVEL;
+    statsStop();
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "j:sO:c", longopts, NULL)) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case OptEmitJobs:
+            emitJobs = atoi(optarg);
+            if (emitJobs < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            streaming = 1;
+            break;
+        case 'c':
+            object = 1;
+            break;
+        case 'O':
+            if (optarg[0] < '0' || optarg[0] > '3' || optarg[1] != '\0') {
+                usage(argv[0]);
+            }
+            optLevel = optarg[0] - '0';
+            break;
+        case OptStats:
+            if (optarg != NULL && strcmp(optarg, "json") != 0) {
+                usage(argv[0]);
+            }
+            stats = 1;
+            statsJson = (optarg != NULL);
+            break;
+        case OptTimePasses:
+            stats = 1;
+            timePasses = 1;
+            break;
+        case OptDumpAst:
+            if (optarg != NULL && strcmp(optarg, "sexpr") != 0) {
+                usage(argv[0]);
+            }
+            dumpFormat = (optarg != NULL ? DumpSexpr : DumpTree);
+            break;
+        case OptServer:
+            if (serving) {
+                usage(argv[0]);
+            }
+            serverPath = (optarg != NULL ? optarg : serverSocketPath());
+            if (serverPath == NULL) {
+                return EXIT_FAILURE;
+            }
+            break;
+        case OptCache:
+            cacheDir = optarg;
+            break;
+        case OptCacheSize:
+            cacheSize = atol(optarg);
+            if (cacheSize < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case OptDiagnostics:
+            if (strcmp(optarg, "text") == 0) {
+                diagFormat = DiagText;
+            } else if (strcmp(optarg, "json") == 0) {
+                diagFormat = DiagJson;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case OptErrorLimit: {
+            char *e;
+            errorLimit = strtol(optarg, &e, 10);
+            if (e == optarg || *e != '\0' || errorLimit < 0) {
+                usage(argv[0]);
+            }
+            break;
+        }
+        case OptIncremental:
+            incremental = 1;
+            break;
+        case OptNoVerboseAsm:
+            verboseAsm = 0;
+            break;
+        case OptExport: {
+            const char *p = optarg;
+            for (;;) {
+                const char *e = strchr(p, ',');
+                size_t n = (e != NULL ? e - p : strlen(p));
+                if (n == 0) {
+                    usage(argv[0]);
+                }
+                exports.push_back(string(p, n));
+                if (e == NULL) {
+                    break;
+                }
+                p = e + 1;
+            }
+            break;
+        }
+        case OptRun:
+        case OptInterpret:
+        case OptTiered: {
+            /* function,arg,... with decimal arguments. */
+            const char *p = strchr(optarg, ',');
+            runEntry.assign(optarg, p != NULL ? p - optarg : strlen(optarg));
+            runArgs.clear();
+            while (p != NULL) {
+                char *e;
+                runArgs.push_back(strtol(p + 1, &e, 10));
+                if (e == p + 1 || (*e != ',' && *e != '\0')) {
+                    usage(argv[0]);
+                }
+                p = (*e == ',' ? e : NULL);
+            }
+            if (runEntry.empty()) {
+                usage(argv[0]);
+            }
+            running = 1;
+            interpret = (opt != OptRun);
+            tiered = (opt == OptTiered);
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* Several files are compiled as separate units on a pool of jobs
+       threads; -j then no longer applies within a unit. */
+    int nfiles = argc - optind;
+    if (nfiles <= 1 && (streaming || dumpFormat != DumpNone) && jobs > 1) {
+        usage(argv[0]);
+    }
+    if (running && (nfiles > 1 || streaming || dumpFormat != DumpNone ||
+                    (interpret && jobs > 1))) {
+        usage(argv[0]);
+    }
+    if (emitJobs > 0 && (nfiles > 1 || incremental || streaming || running ||
+                         dumpFormat != DumpNone)) {
+        usage(argv[0]);
+    }
+    /* Whole program optimization needs the whole program at once. */
+    if (!exports.empty() && (streaming || running)) {
+        usage(argv[0]);
+    }
+    /* Incremental builds update the .s file of each source file. */
+    if (incremental && (nfiles == 0 || streaming || running ||
+                        dumpFormat != DumpNone || !exports.empty())) {
+        usage(argv[0]);
+    }
+    /* An object file is written in one piece, at the end. */
+    if (object && (streaming || incremental || running || dumpFormat != DumpNone)) {
+        usage(argv[0]);
+    }
+
+    if (stats) {
+        statsStart(timePasses);
+    }
+
+    yydebug = 0;
+    /* The interpreter gets by without setting up LLVM. */
+    if (!interpret || tiered || serverPath != NULL) {
+        initTarget(verboseAsm);
+    }
+
+    if (serverPath != NULL) {
+        serving = 1;
+        return serve(serverPath, run);
+    }
+
+    CompileOptions opts;
+    opts.jobs = (nfiles > 1 || incremental ? 1 : jobs);
+    opts.emitJobs = (emitJobs > 0 ? emitJobs : opts.jobs);
+    opts.streaming = streaming;
+    opts.dump = dumpFormat;
+    opts.cache = NULL;
+    opts.run = (running ? runEntry.c_str() : NULL);
+    opts.runArgs = runArgs;
+    opts.interpret = interpret;
+    opts.tiered = tiered;
+    opts.exports = exports;
+    opts.diagFormat = diagFormat;
+    opts.errorLimit = errorLimit;
+    opts.incremental = incremental;
+    opts.object = object;
+    if (cacheDir != NULL) {
+        opts.cache = new FunctionCache(cacheDir,
+                                       (unsigned long long)cacheSize << 20);
+    }
+
+    int err;
+    if (nfiles > 1 || incremental) {
+        err = compileUnits(opts, argv + optind, nfiles, jobs);
+    } else {
+        /* Without file arguments, the program is read from stdin. */
+        const char *path = (nfiles == 1 ? argv[optind] : NULL);
+        SourceFile f;
+        if (f.open(path) != 0) {
+            perror(path != NULL ? path : "stdin");
+            exit(EXIT_FAILURE);
+        }
+        CompilerSession session(opts, stdout, path);
+        err = session.compile(f.data(), f.size());
+    }
+
+    if (opts.cache != NULL) {
+        opts.cache->evict();
+        delete opts.cache;
+    }
+
+    if (stats) {
+        printStats(statsJson);
+    }
+
+    return err;
+}
+
+int main(int argc, char **argv) {
+    return run(argc, argv);
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "incremental.hpp"
+
+using std::string;
+using std::vector;
+using std::map;
+
+/* First line of an index, followed by the size of the assembly file. */
+#define INDEX_MAGIC "asmindex 1"
+#define INDEX_SUFFIX ".idx"
+
+/* Reads the whole file path into data. Returns nonzero on failure. */
+static int readFile(const string &path, string &data) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    data.resize(st.st_size);
+    size_t n = 0;
+    while (n < data.size()) {
+        ssize_t k = read(fd, &data[n], data.size() - n);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            break;
+        }
+        n += k;
+    }
+    close(fd);
+    return n != data.size();
+}
+
+void AsmIndex::load(const string &path) {
+    string idx;
+    if (readFile(path + INDEX_SUFFIX, idx) != 0 || readFile(path, m_asm) != 0) {
+        return;
+    }
+
+    /* The index is only valid for the assembly it was written with. */
+    const char *p = idx.c_str();
+    unsigned long size;
+    int n;
+    if (sscanf(p, INDEX_MAGIC " %lu\n%n", &size, &n) != 1 || size != m_asm.size()) {
+        m_asm.clear();
+        return;
+    }
+    p += n;
+
+    char key[64];
+    unsigned long len;
+    while (sscanf(p, "%63s %lu\n%n", key, &len, &n) == 2) {
+        if (len > m_asm.size() - m_size) {
+            break;
+        }
+        m_keys[key] = m_entries.size();
+        add(key, len);
+        p += n;
+    }
+    if (*p != '\0' || m_size != m_asm.size()) {
+        m_entries.clear();
+        m_keys.clear();
+        m_asm.clear();
+        m_size = 0;
+    }
+}
+
+int AsmIndex::lookup(const string &key, const char *&text, size_t &len) const {
+    map<string, size_t>::const_iterator i = m_keys.find(key);
+    if (i == m_keys.end()) {
+        return 0;
+    }
+    const Entry &e = m_entries[i->second];
+    text = m_asm.data() + e.offset;
+    len = e.size;
+    return 1;
+}
+
+void AsmIndex::add(const string &key, size_t len) {
+    Entry e;
+    e.key = key;
+    e.offset = m_size;
+    e.size = len;
+    m_entries.push_back(e);
+    m_size += len;
+}
+
+/* Written to a temporary file first, so a crash never leaves a partial
+   index behind. */
+int AsmIndex::save(const string &path) const {
+    string idxPath = path + INDEX_SUFFIX;
+    string tmpPath = idxPath + ".tmp";
+    FILE *f = fopen(tmpPath.c_str(), "w");
+    if (f == NULL) {
+        return 1;
+    }
+    fprintf(f, INDEX_MAGIC " %lu\n", (unsigned long)m_size);
+    for (unsigned int i = 0; i < m_entries.size(); i++) {
+        fprintf(f, "%s %lu\n", m_entries[i].key.c_str(), (unsigned long)m_entries[i].size);
+    }
+    if (fclose(f) != 0 || rename(tmpPath.c_str(), idxPath.c_str()) != 0) {
+        unlink(tmpPath.c_str());
+        return 1;
+    }
+    return 0;
+}
+
+void AsmIndex::remove(const string &path) {
+    unlink((path + INDEX_SUFFIX).c_str());
+}
@@ -0,0 +1,46 @@
+#include <string>
+#include <vector>
+#include <map>
+
+/* Sidecar index of an assembly file written with --incremental, stored
+   next to it with the suffix .idx. It lists the functions of the file in
+   order, each with the key of its source text and the size of its
+   assembly. The next run copies the assembly of every function whose key
+   it finds from the previous file instead of compiling it again. */
+class AsmIndex {
+    struct Entry {
+        std::string key;
+        size_t offset;
+        size_t size;
+    };
+    std::vector<Entry> m_entries;
+    /* Entry by key. */
+    std::map<std::string, size_t> m_keys;
+    /* Assembly the entries refer to, if loaded. */
+    std::string m_asm;
+    size_t m_size;
+
+    AsmIndex(const AsmIndex &);
+    AsmIndex &operator=(const AsmIndex &);
+public:
+    AsmIndex() : m_size(0) {}
+
+    /* Reads the index of the assembly file path, and the file itself.
+       Leaves the index empty if either is missing or they do not match. */
+    void load(const std::string &path);
+
+    /* Returns nonzero and points text to the assembly of the function
+       with key, if known. */
+    int lookup(const std::string &key, const char *&text, size_t &len) const;
+
+    /* Appends a function whose assembly of len bytes follows the previous
+       one. */
+    void add(const std::string &key, size_t len);
+
+    /* Writes the index of the assembly file path. Returns nonzero on
+       failure. */
+    int save(const std::string &path) const;
+
+    /* Removes the index of path, if any. */
+    static void remove(const std::string &path);
+};
@@ -0,0 +1,729 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <dlfcn.h>
+#include <map>
+#include <algorithm>
+
+#include "common.hpp"
+#include "interp.hpp"
+#include "gram.tab.hpp"
+
+/* Registers of all active frames, like a native stack of 8 MiB. */
+#define STACK_SLOTS (1 << 20)
+#define MAX_DEPTH (1 << 18)
+
+/* Native functions are called with up to this many arguments. */
+#define MAX_NATIVE_ARGS 6
+
+/* Calls and backward gotos after which a function is compiled. */
+#define TIER_THRESHOLD 1000
+
+using std::map;
+
+/* Translates one function at a time. Variables get fixed registers when
+   their scope is entered; temporaries are allocated above them like a
+   stack and released after every statement. */
+class BytecodeBuilder {
+    BytecodeProgram &m_p;
+    int m_fn;
+    map<sym_t, int> m_vars;
+    int m_nvars;
+    int m_top;
+    int m_max;
+    map<sym_t, int> m_labels;
+    vector<std::pair<int, sym_t> > m_gotos;
+public:
+    BytecodeBuilder(BytecodeProgram &p)
+        : m_p(p), m_fn(-1), m_nvars(0), m_top(0), m_max(0) {}
+
+    /* Returns the index of the function name called with npars
+       arguments. */
+    int function(sym_t name, int npars) {
+        if (name >= (int)m_p.m_index.size()) {
+            m_p.m_index.resize(name + 1, -1);
+        }
+        int i = m_p.m_index[name];
+        if (i < 0) {
+            BytecodeFunction f;
+            f.name = name;
+            f.npars = npars;
+            f.nregs = 0;
+            f.entry = -1;
+            f.native = NULL;
+            f.ast = NULL;
+            f.heat = 0;
+            f.queued = false;
+            f.jitted = NULL;
+            f.compiled = NULL;
+            i = m_p.m_index[name] = m_p.m_funcs.size();
+            m_p.m_funcs.push_back(f);
+        } else if (m_p.m_funcs[i].npars != npars) {
+            fprintf(stderr, "Incorrect number of args passed to %s.\n", syms->get(name));
+            m_p.m_err = ERR_SCOPE;
+        }
+        return i;
+    }
+
+    void begin(sym_t name, int npars) {
+        m_fn = function(name, npars);
+        m_p.m_funcs[m_fn].entry = here();
+    }
+
+    /* Index of the function being translated. */
+    int current() const { return m_fn; }
+
+    /* Whether a call of name with npars arguments calls the function
+       being translated. */
+    bool isCurrent(sym_t name, int npars) const {
+        const BytecodeFunction &f = m_p.m_funcs[m_fn];
+        return f.name == name && f.npars == npars;
+    }
+
+    /* Jumps back to the start of the function being translated. */
+    void restart() { emit(OpLoop, m_p.m_funcs[m_fn].entry, m_fn); }
+
+    /* Same as function(), for a call from the current function. */
+    int callee(sym_t name, int npars) {
+        int i = function(name, npars);
+        m_p.m_funcs[m_fn].callees.push_back(i);
+        return i;
+    }
+
+    /* Resolves gotos and finishes the frame of the function. */
+    void end() {
+        for (unsigned int i = 0; i < m_gotos.size(); i++) {
+            Insn &insn = m_p.m_code[m_gotos[i].first];
+            insn.a = m_labels[m_gotos[i].second];
+            if (insn.a <= m_gotos[i].first) {
+                insn.op = OpLoop;
+                insn.b = m_fn;
+            }
+        }
+        m_p.m_funcs[m_fn].nregs = m_max;
+    }
+
+    int declare(sym_t v) {
+        map<sym_t, int>::iterator it = m_vars.find(v);
+        if (it != m_vars.end()) {
+            return it->second;
+        }
+        m_vars[v] = m_nvars++;
+        reset(m_nvars);
+        return m_nvars - 1;
+    }
+
+    int var(sym_t v) const {
+        map<sym_t, int>::const_iterator it = m_vars.find(v);
+        assert(it != m_vars.end());
+        return it->second;
+    }
+
+    /* Temporaries do not live across statements. */
+    void statement() { m_top = m_nvars; }
+
+    int mark() const { return m_top; }
+    void reset(int top) {
+        m_top = top;
+        if (m_max < m_top) {
+            m_max = m_top;
+        }
+    }
+
+    /* Reserves n consecutive registers and returns the first. */
+    int reserve(int n) {
+        int r = m_top;
+        reset(m_top + n);
+        return r;
+    }
+
+    /* Returns dst if set, or a new temporary. */
+    int target(int dst) { return dst >= 0 ? dst : reserve(1); }
+
+    int here() const { return m_p.m_code.size(); }
+
+    /* Appends an instruction and returns its offset. */
+    int emit(int op, int a, int b = 0, int c = 0) {
+        Insn insn = { op, a, b, c };
+        m_p.m_code.push_back(insn);
+        return here() - 1;
+    }
+
+    void move(int dst, int src) {
+        if (dst != src) {
+            emit(OpMove, dst, src);
+        }
+    }
+
+    int constant(long v) {
+        m_p.m_consts.push_back(v);
+        return m_p.m_consts.size() - 1;
+    }
+
+    void label(sym_t l) { m_labels[l] = here(); }
+    void jump(sym_t l) { m_gotos.push_back(std::make_pair(emit(OpJump, -1), l)); }
+
+    /* Sets the target of the conditional jump at offset at. */
+    void patch(int at, int target) {
+        Insn &insn = m_p.m_code[at];
+        if (insn.op == OpJumpZero) {
+            insn.b = target;
+        } else {
+            insn.c = target;
+        }
+    }
+};
+
+BytecodeProgram::BytecodeProgram(CompilerSession *session)
+    : m_err(0), m_linked(false), m_session(session), m_started(false), m_stop(false)
+{
+    pthread_mutex_init(&m_lock, NULL);
+    pthread_cond_init(&m_wake, NULL);
+}
+
+BytecodeProgram::~BytecodeProgram() {
+    if (m_started) {
+        pthread_mutex_lock(&m_lock);
+        m_stop = true;
+        pthread_cond_signal(&m_wake);
+        pthread_mutex_unlock(&m_lock);
+        pthread_join(m_thread, NULL);
+    }
+    pthread_cond_destroy(&m_wake);
+    pthread_mutex_destroy(&m_lock);
+}
+
+void BytecodeProgram::add(ExprAST *fn) {
+    BytecodeBuilder b(*this);
+    fn->bytecode(b, -1);
+    m_linked = false;
+    if (m_session != NULL) {
+        m_funcs[b.current()].ast = fn;
+    }
+}
+
+/* Looks up the functions which are called but not defined. */
+int BytecodeProgram::link() {
+    if (m_linked) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < m_funcs.size(); i++) {
+        BytecodeFunction &f = m_funcs[i];
+        if (f.entry >= 0 || f.native != NULL) {
+            continue;
+        }
+        const char *name = syms->get(f.name);
+        f.native = dlsym(RTLD_DEFAULT, name);
+        if (f.native == NULL) {
+            fprintf(stderr, "ERROR: undefined function %s\n", name);
+            return 1;
+        }
+        if (f.npars > MAX_NATIVE_ARGS) {
+            fprintf(stderr, "ERROR: too many arguments for %s\n", name);
+            return 1;
+        }
+    }
+    for (unsigned int i = 0; i < m_code.size(); i++) {
+        if (m_code[i].op == OpCall && m_funcs[m_code[i].b].entry < 0) {
+            m_code[i].op = OpCallNative;
+        }
+    }
+    m_linked = true;
+    return 0;
+}
+
+/* Queues fn for compilation and starts the compiler thread if needed. */
+void BytecodeProgram::tierUp(int fn) {
+    BytecodeFunction &f = m_funcs[fn];
+    if (f.queued || f.npars > MAX_NATIVE_ARGS) {
+        return;
+    }
+    f.queued = true;
+
+    pthread_mutex_lock(&m_lock);
+    m_requests.push_back(fn);
+    pthread_cond_signal(&m_wake);
+    pthread_mutex_unlock(&m_lock);
+
+    /* Without a thread, everything just stays interpreted. */
+    if (!m_started) {
+        m_started = (pthread_create(&m_thread, NULL, compilerThread, this) == 0);
+    }
+}
+
+void *BytecodeProgram::compilerThread(void *arg) {
+    BytecodeProgram *p = static_cast<BytecodeProgram *>(arg);
+    syms = &p->m_session->symbols;
+
+    pthread_mutex_lock(&p->m_lock);
+    for (;;) {
+        while (p->m_requests.empty() && !p->m_stop) {
+            pthread_cond_wait(&p->m_wake, &p->m_lock);
+        }
+        if (p->m_stop) {
+            break;
+        }
+        int fn = p->m_requests.front();
+        p->m_requests.erase(p->m_requests.begin());
+        pthread_mutex_unlock(&p->m_lock);
+
+        p->compileHot(fn);
+
+        pthread_mutex_lock(&p->m_lock);
+    }
+    pthread_mutex_unlock(&p->m_lock);
+    return NULL;
+}
+
+/* Compiles fn along with everything it calls, so the native code never
+   has to call back into the interpreter. Functions compiled for an
+   earlier request are not compiled again; calls to them go to their
+   code. */
+void BytecodeProgram::compileHot(int fn) {
+    if (m_funcs[fn].compiled != NULL) {
+        return;
+    }
+    vector<int> order(1, fn);
+    vector<std::pair<sym_t, void *> > known;
+    vector<bool> seen(m_funcs.size(), false);
+    seen[fn] = true;
+    for (unsigned int i = 0; i < order.size(); i++) {
+        const vector<int> &callees = m_funcs[order[i]].callees;
+        for (unsigned int j = 0; j < callees.size(); j++) {
+            int c = callees[j];
+            if (seen[c] || m_funcs[c].entry < 0) {
+                continue;
+            }
+            seen[c] = true;
+            if (m_funcs[c].compiled != NULL) {
+                known.push_back(std::make_pair(m_funcs[c].name, m_funcs[c].compiled));
+            } else {
+                order.push_back(c);
+            }
+        }
+    }
+
+    vector<ExprAST *> asts;
+    for (unsigned int i = 0; i < order.size(); i++) {
+        asts.push_back(m_funcs[order[i]].ast);
+    }
+    vector<void *> addrs;
+    if (jitFunctions(m_session, asts, known, addrs) != 0) {
+        return;
+    }
+
+    __sync_synchronize();
+    for (unsigned int i = 0; i < order.size(); i++) {
+        BytecodeFunction &f = m_funcs[order[i]];
+        f.compiled = addrs[i];
+        if (f.npars <= MAX_NATIVE_ARGS) {
+            f.jitted = addrs[i];
+        }
+    }
+}
+
+typedef long (*Native0)();
+typedef long (*Native1)(long);
+typedef long (*Native2)(long, long);
+typedef long (*Native3)(long, long, long);
+typedef long (*Native4)(long, long, long, long);
+typedef long (*Native5)(long, long, long, long, long);
+typedef long (*Native6)(long, long, long, long, long, long);
+
+/* Calls the native function p with n arguments from a. */
+static long callNative(void *p, int n, const long *a) {
+    switch (n) {
+    case 0: return (__extension__ (Native0)p)();
+    case 1: return (__extension__ (Native1)p)(a[0]);
+    case 2: return (__extension__ (Native2)p)(a[0], a[1]);
+    case 3: return (__extension__ (Native3)p)(a[0], a[1], a[2]);
+    case 4: return (__extension__ (Native4)p)(a[0], a[1], a[2], a[3]);
+    case 5: return (__extension__ (Native5)p)(a[0], a[1], a[2], a[3], a[4]);
+    default: return (__extension__ (Native6)p)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+}
+
+struct Frame {
+    const Insn *ret;
+    long *regs;
+    int dst;
+};
+
+/* Arithmetic wraps around like in the generated code. */
+#define WRAP(x, op, y) ((long)((unsigned long)(x) op (unsigned long)(y)))
+
+/* Every handler jumps straight to the next one through the table, so
+   each has a branch of its own to predict. */
+#define HANDLER(op) __extension__ &&do_##op
+#define DISPATCH() __extension__ ({ goto *dispatch[pc->op]; })
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+#define R(x) regs[pc->x]
+
+int BytecodeProgram::run(const char *name, const vector<long> &args, long &ret) {
+    if (m_err != 0) {
+        return 1;
+    }
+    int fn = -1;
+    for (unsigned int i = 0; i < m_funcs.size(); i++) {
+        if (m_funcs[i].entry >= 0 && strcmp(syms->get(m_funcs[i].name), name) == 0) {
+            fn = i;
+        }
+    }
+    if (fn < 0 || m_funcs[fn].npars != (int)args.size()) {
+        fprintf(stderr, "ERROR: no function %s with %lu parameters\n",
+                name, (unsigned long)args.size());
+        return 1;
+    }
+    if (link() != 0) {
+        return 1;
+    }
+
+    static void *const dispatch[OpCount] = {
+        HANDLER(OpMove), HANDLER(OpConst), HANDLER(OpAdd), HANDLER(OpMul),
+        HANDLER(OpAnd), HANDLER(OpLessEq), HANDLER(OpNotEq), HANDLER(OpNot),
+        HANDLER(OpNeg), HANDLER(OpLoad), HANDLER(OpStore), HANDLER(OpJump),
+        HANDLER(OpLoop), HANDLER(OpJumpZero), HANDLER(OpJumpGreater), HANDLER(OpJumpEqual),
+        HANDLER(OpCall), HANDLER(OpCallNative), HANDLER(OpReturn)
+    };
+    const Insn *code = &m_code[0];
+    const long *consts = (m_consts.empty() ? NULL : &m_consts[0]);
+    BytecodeFunction *funcs = &m_funcs[0];
+
+    /* Not zeroed as a whole, so untouched pages are never mapped in. */
+    long *stack = (long *)malloc(STACK_SLOTS * sizeof(long));
+    assert(stack != NULL);
+    long *limit = stack + STACK_SLOTS;
+    vector<Frame> frames;
+
+    long *regs = stack;
+    const Insn *pc;
+    {
+        const BytecodeFunction &f = funcs[fn];
+        std::copy(args.begin(), args.end(), regs);
+        memset(regs + f.npars, 0, (f.nregs - f.npars) * sizeof(long));
+        pc = code + f.entry;
+    }
+    DISPATCH();
+
+do_OpMove:
+    R(a) = R(b);
+    NEXT();
+do_OpConst:
+    R(a) = consts[pc->b];
+    NEXT();
+do_OpAdd:
+    R(a) = WRAP(R(b), +, R(c));
+    NEXT();
+do_OpMul:
+    R(a) = WRAP(R(b), *, R(c));
+    NEXT();
+do_OpAnd:
+    R(a) = R(b) & R(c);
+    NEXT();
+do_OpLessEq:
+    R(a) = (R(b) <= R(c));
+    NEXT();
+do_OpNotEq:
+    R(a) = (R(b) != R(c));
+    NEXT();
+do_OpNot:
+    R(a) = ~R(b);
+    NEXT();
+do_OpNeg:
+    R(a) = WRAP(0, -, R(b));
+    NEXT();
+do_OpLoad:
+    R(a) = *(long *)R(b);
+    NEXT();
+do_OpStore:
+    *(long *)R(a) = R(b);
+    NEXT();
+do_OpJump:
+    pc = code + pc->a;
+    DISPATCH();
+do_OpLoop:
+    if (++funcs[pc->b].heat == TIER_THRESHOLD && m_session != NULL) {
+        tierUp(pc->b);
+    }
+    pc = code + pc->a;
+    DISPATCH();
+do_OpJumpZero:
+    pc = (R(a) == 0 ? code + pc->b : pc + 1);
+    DISPATCH();
+do_OpJumpGreater:
+    pc = (R(a) > R(b) ? code + pc->c : pc + 1);
+    DISPATCH();
+do_OpJumpEqual:
+    pc = (R(a) == R(b) ? code + pc->c : pc + 1);
+    DISPATCH();
+do_OpCall: {
+    BytecodeFunction &f = funcs[pc->b];
+    void *jitted = f.jitted;
+    if (jitted != NULL) {
+        R(a) = callNative(jitted, f.npars, regs + pc->c);
+        NEXT();
+    }
+    if (++f.heat == TIER_THRESHOLD && m_session != NULL) {
+        tierUp(pc->b);
+    }
+    long *callee = regs + pc->c;
+    if (callee + f.nregs > limit || frames.size() == MAX_DEPTH) {
+        fprintf(stderr, "ERROR: stack overflow in %s\n", syms->get(f.name));
+        free(stack);
+        return 1;
+    }
+    Frame fr = { pc + 1, regs, pc->a };
+    frames.push_back(fr);
+    regs = callee;
+    memset(regs + f.npars, 0, (f.nregs - f.npars) * sizeof(long));
+    pc = code + f.entry;
+    DISPATCH();
+}
+do_OpCallNative: {
+    const BytecodeFunction &f = funcs[pc->b];
+    R(a) = callNative(f.native, f.npars, regs + pc->c);
+    NEXT();
+}
+do_OpReturn: {
+    long v = R(a);
+    if (frames.empty()) {
+        ret = v;
+        free(stack);
+        return 0;
+    }
+    const Frame &fr = frames.back();
+    regs = fr.regs;
+    regs[fr.dst] = v;
+    pc = fr.ret;
+    frames.pop_back();
+    DISPATCH();
+}
+}
+
+int runBytecode(CompilerSession *s) {
+    long ret;
+    if (s->bytecode->run(s->opts.run, s->opts.runArgs, ret) != 0) {
+        return EXIT_FAILURE;
+    }
+    fprintf(s->out, "%ld\n", ret);
+    return 0;
+}
+
+/* Appends bytecode which evaluates the expression e of the current pool
+   to b, as ExprAST::bytecode() does. */
+static int exprBytecode(BytecodeBuilder &b, expr_t e, int dst) {
+    const ExprPool &p = *exprPool;
+    int top, l, r, d, op;
+
+    switch (p.kind(e)) {
+    case ExprNumber:
+        d = b.target(dst);
+        b.emit(OpConst, d, b.constant(p.value(e)));
+        return d;
+    case ExprSymbol:
+        return b.var(p.sym(e));
+    case ExprCall: {
+        unsigned int n = p.argCount(e);
+        int fn = b.callee(p.sym(e), n);
+
+        /* The arguments are computed right into place; anything needed
+           on the way lives above them. */
+        top = b.mark();
+        int base = b.reserve(n);
+        for (unsigned int i = 0; i < n; i++) {
+            b.move(base + i, exprBytecode(b, p.arg(e, i), base + i));
+            b.reset(base + n);
+        }
+        b.reset(top);
+
+        d = b.target(dst);
+        b.emit(OpCall, d, fn, base);
+        return d;
+    }
+    case ExprUnary:
+        top = b.mark();
+        l = exprBytecode(b, p.lhs(e), -1);
+        b.reset(top);
+
+        switch (p.op(e)) {
+        case NOT: op = OpNot; break;
+        case UNARYMINUS: op = OpNeg; break;
+        case DEREF: op = OpLoad; break;
+        default:
+            assert(0);
+            return -1;
+        }
+        d = b.target(dst);
+        b.emit(op, d, l);
+        return d;
+    case ExprBinary:
+        top = b.mark();
+        l = exprBytecode(b, p.lhs(e), -1);
+        r = exprBytecode(b, p.rhs(e), -1);
+        b.reset(top);
+
+        switch (p.op(e)) {
+        case '*': op = OpMul; break;
+        case '+': op = OpAdd; break;
+        case AND: op = OpAnd; break;
+        case OPLESSEQ: op = OpLessEq; break;
+        case '#': op = OpNotEq; break;
+        default:
+            assert(0);
+            return -1;
+        }
+        d = b.target(dst);
+        b.emit(op, d, l, r);
+        return d;
+    default:
+        /* Addresses are only used as the target of assignments and
+           gotos, which are translated by their statements. */
+        assert(0);
+        return -1;
+    }
+}
+
+/* Appends bytecode which jumps if the value of e is 0. Returns the offset
+   of the jump, whose target is set with BytecodeBuilder::patch().
+   Comparisons branch directly instead of producing 0 or 1 first. */
+static int exprJumpUnless(BytecodeBuilder &b, expr_t e) {
+    const ExprPool &p = *exprPool;
+    int top = b.mark();
+    if (p.kind(e) == ExprBinary && (p.op(e) == OPLESSEQ || p.op(e) == '#')) {
+        int l = exprBytecode(b, p.lhs(e), -1);
+        int r = exprBytecode(b, p.rhs(e), -1);
+        b.reset(top);
+        return b.emit(p.op(e) == OPLESSEQ ? OpJumpGreater : OpJumpEqual, l, r, -1);
+    }
+    int v = exprBytecode(b, e, -1);
+    b.reset(top);
+    return b.emit(OpJumpZero, v, -1);
+}
+
+/* Same for a return of the call e, where only calls of the current
+   function are handled. Returns false if nothing has been appended. */
+static bool exprBytecodeTail(BytecodeBuilder &b, expr_t e) {
+    const ExprPool &p = *exprPool;
+    unsigned int n = p.argCount(e);
+    if (!b.isCurrent(p.sym(e), n)) {
+        return false;
+    }
+
+    /* All arguments are computed before any parameter changes. */
+    int top = b.mark();
+    int base = b.reserve(n);
+    for (unsigned int i = 0; i < n; i++) {
+        b.move(base + i, exprBytecode(b, p.arg(e, i), base + i));
+        b.reset(base + n);
+    }
+    for (unsigned int i = 0; i < n; i++) {
+        b.move(i, base + i);
+    }
+    b.reset(top);
+    b.restart();
+    return true;
+}
+
+int FunctionExprAST::bytecode(BytecodeBuilder &b, int) const {
+    UsePool use(m_exprs);
+    b.begin(m_name, m_pars.size());
+
+    /* Parameters come first in the frame, where the caller put them. */
+    for (unsigned int i = 0; i < m_pars.size(); i++) {
+        b.declare(m_pars[i]);
+    }
+    const SymVector &variables = m_scope->variables();
+    for (unsigned int i = 0; i < variables.size(); i++) {
+        b.declare(variables[i]);
+    }
+    for (unsigned int i = 0; i < m_stats.size(); i++) {
+        m_stats[i]->bytecodeDeclare(b);
+    }
+
+    for (unsigned int i = 0; i < m_stats.size(); i++) {
+        b.statement();
+        m_stats[i]->bytecode(b, -1);
+    }
+
+    /* Without a return statement, 0 is returned. */
+    b.statement();
+    int r = b.target(-1);
+    b.emit(OpConst, r, b.constant(0));
+    b.emit(OpReturn, r);
+
+    b.end();
+    return -1;
+}
+
+int StatementExprAST::bytecode(BytecodeBuilder &b, int) const {
+    for (unsigned int i = 0; i < m_labels.size(); i++) {
+        b.label(m_labels[i]);
+    }
+    m_stat->bytecode(b, -1);
+    return -1;
+}
+
+void IfExprAST::bytecodeDeclare(BytecodeBuilder &b) const {
+    const SymVector &variables = m_scope->variables();
+    for (unsigned int i = 0; i < variables.size(); i++) {
+        b.declare(variables[i]);
+    }
+    for (unsigned int i = 0; i < m_then.size(); i++) {
+        m_then[i]->bytecodeDeclare(b);
+    }
+}
+
+int IfExprAST::bytecode(BytecodeBuilder &b, int) const {
+    /* Left by fold() for its scope, the statements simply run. */
+    long c;
+    bool always = exprPool->constantValue(m_cond, c) && c != 0;
+
+    int j = (always ? -1 : exprJumpUnless(b, m_cond));
+    for (unsigned int i = 0; i < m_then.size(); i++) {
+        b.statement();
+        m_then[i]->bytecode(b, -1);
+    }
+    if (!always) {
+        b.patch(j, b.here());
+    }
+    return -1;
+}
+
+int SimpleExprAST::bytecode(BytecodeBuilder &b, int) const {
+    const ExprPool &p = *exprPool;
+    int top, l, r;
+
+    switch (m_op) {
+    case VAR:
+    case '=':
+        if (p.kind(m_lhs) == ExprAddr) {
+            int v = b.var(p.sym(m_lhs));
+            b.move(v, exprBytecode(b, m_rhs, v));
+            return -1;
+        }
+        top = b.mark();
+        l = exprBytecode(b, m_lhs, -1);
+        r = exprBytecode(b, m_rhs, -1);
+        b.reset(top);
+        b.emit(OpStore, l, r);
+        return -1;
+    case GOTO:
+        b.jump(p.sym(m_lhs));
+        return -1;
+    case RETURN:
+        if (p.kind(m_lhs) == ExprCall && exprBytecodeTail(b, m_lhs)) {
+            return -1;
+        }
+        top = b.mark();
+        l = exprBytecode(b, m_lhs, -1);
+        b.reset(top);
+        b.emit(OpReturn, l);
+        return -1;
+    default:
+        top = b.mark();
+        exprBytecode(b, m_lhs, -1);
+        b.reset(top);
+        return -1;
+    }
+}
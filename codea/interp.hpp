@@ -0,0 +1,112 @@
+/* Register based bytecode, for running a program right after it has been
+   checked, without generating code through LLVM. Each function works on a
+   frame of 64 bit registers: its parameters come first, then its variables,
+   then temporaries. A call passes its arguments in consecutive registers
+   at the top of the caller's frame, which become the parameters of the
+   callee's frame.
+
+   With tiering, the interpreter counts calls and backward gotos of every
+   function. Once a function gets hot, it is compiled to native code on a
+   background thread, and later calls run that code instead. */
+
+#include <vector>
+#include <string>
+#include <pthread.h>
+
+enum Opcode {
+    OpMove,         /* a = b */
+    OpConst,        /* a = constant b */
+    OpAdd,          /* a = b + c */
+    OpMul,          /* a = b * c */
+    OpAnd,          /* a = b and c */
+    OpLessEq,       /* a = b =< c */
+    OpNotEq,        /* a = b # c */
+    OpNot,          /* a = not b */
+    OpNeg,          /* a = -b */
+    OpLoad,         /* a = *b */
+    OpStore,        /* *a = b */
+    OpJump,         /* goto a */
+    OpLoop,         /* goto a, backwards in function b */
+    OpJumpZero,     /* if a = 0, goto b */
+    OpJumpGreater,  /* if a > b, goto c */
+    OpJumpEqual,    /* if a = b, goto c */
+    OpCall,         /* a = function b, arguments from c on */
+    OpCallNative,   /* same for a function outside of the program */
+    OpReturn,       /* return a */
+    OpCount
+};
+
+/* Jump targets are offsets into the code of the whole program. */
+struct Insn {
+    int op;
+    int a;
+    int b;
+    int c;
+};
+
+struct BytecodeFunction {
+    sym_t name;
+    int npars;
+    int nregs;
+    /* Offset of the first instruction, -1 if not defined. */
+    int entry;
+    /* Set for functions outside of the program on first run. */
+    void *native;
+
+    /* Kept for tiering only. */
+    ExprAST *ast;
+    /* Indices of the functions called. */
+    std::vector<int> callees;
+    /* Calls and backward gotos so far. */
+    unsigned int heat;
+    /* Set once the function has been queued for compilation. */
+    bool queued;
+    /* Native code, published by the compiler thread. */
+    void *volatile jitted;
+    /* Same, even with too many parameters for the interpreter to call
+       it. Only used by the compiler thread. */
+    void *compiled;
+};
+
+class BytecodeBuilder;
+
+class BytecodeProgram {
+    std::vector<Insn> m_code;
+    std::vector<long> m_consts;
+    std::vector<BytecodeFunction> m_funcs;
+    /* Function index by sym_t, -1 if none. */
+    std::vector<int> m_index;
+    int m_err;
+    bool m_linked;
+
+    /* Session compiling hot functions, NULL without tiering. */
+    CompilerSession *m_session;
+    pthread_t m_thread;
+    pthread_mutex_t m_lock;
+    pthread_cond_t m_wake;
+    std::vector<int> m_requests;
+    bool m_started;
+    bool m_stop;
+
+    BytecodeProgram(const BytecodeProgram &);
+    BytecodeProgram &operator=(const BytecodeProgram &);
+
+    int link();
+    void tierUp(int fn);
+    static void *compilerThread(void *arg);
+    void compileHot(int fn);
+    friend class BytecodeBuilder;
+public:
+    /* Hot functions are compiled in session, if set. */
+    BytecodeProgram(CompilerSession *session);
+    ~BytecodeProgram();
+
+    /* Translates the checked function fn. With tiering, fn has to stay
+       around until the program has been run. */
+    void add(ExprAST *fn);
+
+    /* Calls the function name with args and stores its result in ret.
+       Functions which are not part of the program are looked up in the
+       running process. Returns nonzero after reporting an error. */
+    int run(const char *name, const std::vector<long> &args, long &ret);
+};
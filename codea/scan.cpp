@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.hpp"
+#include "gram.tab.hpp"
+
+#define READ_CHUNK (64 * 1024)
+
+SourceFile::~SourceFile() {
+    if (m_mapped) {
+        munmap(m_data, m_size);
+    } else {
+        free(m_data);
+    }
+}
+
+int SourceFile::open(const char *path) {
+    int fd = (path != NULL ? ::open(path, O_RDONLY) : fileno(stdin));
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            m_data = (char *)p;
+            m_size = st.st_size;
+            m_mapped = true;
+            if (path != NULL) {
+                close(fd);
+            }
+            return 0;
+        }
+    }
+
+    size_t cap = 0;
+    for (;;) {
+        if (m_size == cap) {
+            cap += READ_CHUNK;
+            m_data = (char *)realloc(m_data, cap);
+            assert(m_data != NULL);
+        }
+        ssize_t n = read(fd, m_data + m_size, cap - m_size);
+        if (n < 0) {
+            if (path != NULL) {
+                close(fd);
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        m_size += n;
+    }
+    if (path != NULL) {
+        close(fd);
+    }
+    return 0;
+}
+
+static bool isIdentStart(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int hexValue(char c) {
+    if (isDigit(c)) {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Adds a digit to val. Like strtol, overflow saturates at LONG_MAX. */
+static long addDigit(long val, int base, int d) {
+    if (val > (LONG_MAX - d) / base) {
+        return LONG_MAX;
+    }
+    return val * base + d;
+}
+
+static int keyword(const char *s, size_t len) {
+    switch (len) {
+    case 2:
+        if (memcmp(s, "if", 2) == 0) return IF;
+        break;
+    case 3:
+        if (memcmp(s, "end", 3) == 0) return END;
+        if (memcmp(s, "var", 3) == 0) return VAR;
+        if (memcmp(s, "not", 3) == 0) return NOT;
+        if (memcmp(s, "and", 3) == 0) return AND;
+        break;
+    case 4:
+        if (memcmp(s, "goto", 4) == 0) return GOTO;
+        if (memcmp(s, "then", 4) == 0) return THEN;
+        break;
+    case 6:
+        if (memcmp(s, "return", 6) == 0) return RETURN;
+        break;
+    }
+    return IDENT;
+}
+
+/* Comments end at the first closing *). Inside a comment, a * is taken
+   together with the character after it, so the *) of **) does not close
+   it. Returns the end of the comment whose body starts at p, or NULL if
+   it is never closed; the (* is then scanned as ( and *. */
+static const char *commentEnd(const char *p, const char *end) {
+    for (;;) {
+        p = (const char *)memchr(p, '*', end - p);
+        if (p == NULL || ++p == end) {
+            return NULL;
+        }
+        if (*p == ')') {
+            return p + 1;
+        }
+        p++;
+    }
+}
+
+int Lexer::next(Token &t) {
+    for (;;) {
+        while (m_pos != m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n')) {
+            m_line += (*m_pos == '\n');
+            m_pos++;
+        }
+        if (m_end - m_pos >= 2 && m_pos[0] == '(' && m_pos[1] == '*') {
+            const char *e = commentEnd(m_pos + 2, m_end);
+            if (e != NULL) {
+                for (; m_pos != e; m_pos++) {
+                    m_line += (*m_pos == '\n');
+                }
+                continue;
+            }
+        }
+        break;
+    }
+
+    const char *s = m_pos;
+    t.text = s;
+    t.line = m_line;
+    if (s == m_end) {
+        t.len = 0;
+        t.type = 0;
+        return 0;
+    }
+
+    const char *p = s + 1;
+    if (isIdentStart(*s)) {
+        while (p != m_end && (isIdentStart(*p) || isDigit(*p))) {
+            p++;
+        }
+        t.type = keyword(s, p - s);
+        if (t.type == IDENT) {
+            t.sym = syms->insert(s, p - s);
+        }
+    } else if (isDigit(*s)) {
+        /* The first digit is already part of the number. */
+        long val = *s - '0';
+        int d;
+        while (p != m_end && (d = hexValue(*p)) >= 0) {
+            val = addDigit(val, 16, d);
+            p++;
+        }
+        t.type = NUM;
+        t.val = val;
+    } else if (*s == '&' && p != m_end && isDigit(*p)) {
+        long val = 0;
+        while (p != m_end && isDigit(*p)) {
+            val = addDigit(val, 10, *p - '0');
+            p++;
+        }
+        t.type = NUM;
+        t.val = val;
+    } else if (*s == '=' && p != m_end && *p == '<') {
+        p++;
+        t.type = OPLESSEQ;
+    } else if (*s != '\0' && strchr(";(),:=*-+#", *s) != NULL) {
+        t.type = *s;
+    } else {
+        t.len = 1;
+        t.type = -1;
+        m_pos = p;
+        return -1;
+    }
+
+    t.len = p - s;
+    m_pos = p;
+    return t.type;
+}
+
+void splitFunctions(const char *buf, size_t len, int line, vector<SourceRange> &fns) {
+    Lexer l(buf, len, line);
+    Token t;
+    SourceRange r;
+    int depth = 0;
+    bool inside = false, ending = false;
+    for (;;) {
+        int type = l.next(t);
+        if (type == 0) {
+            break;
+        }
+        if (!inside) {
+            r.text = t.text;
+            r.line = t.line;
+            inside = true;
+        }
+        bool closes = (type == END && depth == 0);
+        if (ending && type == ';') {
+            r.len = t.text + 1 - r.text;
+            fns.push_back(r);
+            inside = false;
+        } else if (type == IF) {
+            depth++;
+        } else if (type == END && depth > 0) {
+            depth--;
+        }
+        ending = closes;
+    }
+    if (inside) {
+        r.len = buf + len - r.text;
+        fns.push_back(r);
+    }
+}
+
+int Lexer::nextBatch(Token &t) {
+    if (m_taken == m_batched) {
+        phaseBegin(PhaseScan);
+        m_batched = 0;
+        m_taken = 0;
+        while (m_batched < LEX_BATCH && next(m_batch[m_batched++]) != 0) {
+        }
+        phaseEnd();
+    }
+    t = m_batch[m_taken++];
+    return t.type;
+}
+
+/* Invalid characters are skipped. Once the error limit has been reached,
+   the input ends. */
+int yylex(YYSTYPE *lval, YYLTYPE *lloc, CompilerSession *session) {
+    Token t;
+    int type;
+    Lexer *l = session->lexer;
+    while ((type = statsEnabled ? l->nextBatch(t) : l->next(t)) < 0) {
+        unsigned char c = *t.text;
+        if (c >= ' ' && c < 0x7f) {
+            diags->error(ERR_LEX, t.line, "invalid character '%c'", c);
+        } else {
+            diags->error(ERR_LEX, t.line, "invalid character 0x%02x", c);
+        }
+        session->fail(ERR_LEX);
+    }
+    if (session->error() != 0 && diags->full()) {
+        type = 0;
+    }
+    lloc->first_line = lloc->last_line = t.line;
+    if (type == NUM) {
+        lval->val = t.val;
+    } else if (type == IDENT) {
+        lval->sym = t.sym;
+    }
+    return type;
+}
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+
+#include "server.hpp"
+
+using std::string;
+using std::vector;
+
+/* Descriptors passed with a request: stdin, stdout, stderr and the
+   working directory of the client. */
+#define REQUEST_FDS (4)
+
+/* Upper bound for the size of the argument block. */
+#define REQUEST_MAX_ARGS (64 * 1024)
+
+/* Creates dir if needed. Fails unless it is a directory which belongs
+   to the user and nobody else may access. */
+static int privateDir(const char *dir) {
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(dir, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        errno = EACCES;
+        return -1;
+    }
+    return 0;
+}
+
+const char *serverSocketPath() {
+    const char *p = getenv("COMPILE_SERVER");
+    if (p != NULL && p[0] != '\0') {
+        return p;
+    }
+
+    static char path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    char dir[sizeof(path)];
+    const char *rt = getenv("XDG_RUNTIME_DIR");
+    if (rt != NULL && rt[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", rt);
+    } else {
+        snprintf(dir, sizeof(dir), SERVER_SOCKET_DIR, (int)getuid());
+    }
+    if (privateDir(dir) != 0) {
+        perror(dir);
+        return NULL;
+    }
+    if (snprintf(path, sizeof(path), "%s/" SERVER_SOCKET_NAME, dir) >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        perror(dir);
+        return NULL;
+    }
+    return path;
+}
+
+/* Whether the process at the other end of sock runs as the same user. */
+static int peerIsUser(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    return getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+        cred.uid == getuid();
+}
+
+static int fillAddress(struct sockaddr_un &addr, const char *path) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    return 0;
+}
+
+static int writeAll(int fd, const void *buf, size_t n) {
+    const char *p = (const char *)buf;
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return -1;
+        }
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static int readAll(int fd, void *buf, size_t n) {
+    char *p = (char *)buf;
+    while (n > 0) {
+        ssize_t k = read(fd, p, n);
+        if (k < 0 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            return -1;
+        }
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+/* A request is the length of the argument block, sent together with
+   the descriptors, followed by the block itself: all arguments, each
+   terminated by a NUL byte. */
+static int sendRequest(int sock, int argc, char **argv, const int fds[REQUEST_FDS]) {
+    string args;
+    for (int i = 0; i < argc; i++) {
+        args.append(argv[i], strlen(argv[i]) + 1);
+    }
+    uint32_t len = args.size();
+
+    char control[CMSG_SPACE(sizeof(int) * REQUEST_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * REQUEST_FDS);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * REQUEST_FDS);
+
+    if (sendmsg(sock, &msg, 0) != (ssize_t)sizeof(len)) {
+        return -1;
+    }
+    return writeAll(sock, args.data(), args.size());
+}
+
+static int recvRequest(int sock, vector<string> &args, int fds[REQUEST_FDS]) {
+    uint32_t len;
+    char control[CMSG_SPACE(sizeof(int) * REQUEST_FDS)];
+    struct iovec iov;
+    iov.iov_base = &len;
+    iov.iov_len = sizeof(len);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, 0) != (ssize_t)sizeof(len)) {
+        return -1;
+    }
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+            c->cmsg_len != CMSG_LEN(sizeof(int) * REQUEST_FDS)) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(c), sizeof(int) * REQUEST_FDS);
+
+    if (len == 0 || len > REQUEST_MAX_ARGS) {
+        return -1;
+    }
+    vector<char> buf(len);
+    if (readAll(sock, &buf[0], len) != 0 || buf[len - 1] != '\0') {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i += args.back().size() + 1) {
+        args.push_back(string(&buf[i]));
+    }
+    return 0;
+}
+
+/* Reports the exit code to the client, whichever way the compiler
+   exits. Output is flushed first so the client never returns before
+   all of it has been written. */
+static void reportExit(int code, void *arg) {
+    int sock = (int)(intptr_t)arg;
+    int32_t c = code;
+    fflush(NULL);
+    writeAll(sock, &c, sizeof(c));
+}
+
+/* Runs in the forked child. Takes over the streams of the client and
+   runs the compiler. */
+static void handleRequest(int sock, int (*run)(int argc, char **argv)) {
+    vector<string> args;
+    int fds[REQUEST_FDS];
+    if (recvRequest(sock, args, fds) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    if (fchdir(fds[3]) != 0) {
+        perror("fchdir");
+        _exit(EXIT_FAILURE);
+    }
+    close(fds[3]);
+
+    vector<char *> argv;
+    for (unsigned int i = 0; i < args.size(); i++) {
+        argv.push_back(&args[i][0]);
+    }
+    argv.push_back(NULL);
+
+    on_exit(reportExit, (void *)(intptr_t)sock);
+    exit(run(args.size(), &argv[0]));
+}
+
+int serve(const char *path, int (*run)(int argc, char **argv)) {
+    struct sockaddr_un addr;
+    if (fillAddress(addr, path) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    unlink(path);
+    /* The socket is only accessible to the user. */
+    mode_t mask = umask(077);
+    int err = bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (err != 0 || listen(sock, SOMAXCONN) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    /* Children are never waited for. */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            return EXIT_FAILURE;
+        }
+        if (!peerIsUser(conn)) {
+            fprintf(stderr, "%s: rejected request of another user\n", path);
+            close(conn);
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            signal(SIGCHLD, SIG_DFL);
+            handleRequest(conn, run);
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
+        close(conn);
+    }
+}
+
+int requestCompile(const char *path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    if (fillAddress(addr, path) != 0) {
+        return -1;
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    /* The streams of the client are not handed to anyone else. */
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || !peerIsUser(sock)) {
+        close(sock);
+        return -1;
+    }
+
+    int fds[REQUEST_FDS] = { 0, 1, 2, open(".", O_RDONLY) };
+    if (fds[3] < 0 || sendRequest(sock, argc, argv, fds) != 0) {
+        close(sock);
+        return -1;
+    }
+    close(fds[3]);
+
+    int32_t code;
+    if (readAll(sock, &code, sizeof(code)) != 0) {
+        /* The compiler died without reporting. */
+        code = EXIT_FAILURE;
+    }
+    close(sock);
+    return code;
+}
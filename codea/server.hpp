@@ -0,0 +1,30 @@
+/* Compile server. A client connects to the Unix socket of the server and
+   sends a single request: its command line arguments, together with its
+   stdin, stdout, stderr and working directory as file descriptors. The
+   server forks a child which runs the compiler on exactly these, so the
+   client behaves like the compiler itself. The child replies with the
+   exit code. Everything set up before the fork, most notably the LLVM
+   target, is shared by all children. As the children open files on
+   behalf of the client, only the user running the server may connect. */
+
+/* Used if COMPILE_SERVER is not set in the environment. The socket is
+   put into $XDG_RUNTIME_DIR, or else into a directory of the user's own
+   in /tmp, named after the uid. */
+#define SERVER_SOCKET_NAME "compile-server.sock"
+#define SERVER_SOCKET_DIR "/tmp/compile-server-%d"
+
+/* Returns the socket path given by the environment or the default.
+   Creates the directory of the default if needed. Returns NULL and
+   reports why if the directory is not private to the user. */
+const char *serverSocketPath();
+
+/* Runs the server on path until it is killed. run is called in a fresh
+   child for every request, with the arguments of the client. Returns
+   only on failure. */
+int serve(const char *path, int (*run)(int argc, char **argv));
+
+/* Connects to the server at path and has it compile with the given
+   arguments and the standard streams of the calling process. Returns
+   the exit code of the compiler, or -1 if the server is not reachable
+   or run by another user. */
+int requestCompile(const char *path, int argc, char **argv);
@@ -0,0 +1 @@
+../codea/cache.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../codea/incremental.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../codea/scan.cpp
\ No newline at end of file
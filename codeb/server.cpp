@@ -0,0 +1 @@
+../codea/server.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../codea/cache.cpp
\ No newline at end of file
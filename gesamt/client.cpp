@@ -0,0 +1 @@
+../codea/client.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../codea/diag.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../codea/diag.hpp
\ No newline at end of file
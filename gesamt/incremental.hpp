@@ -0,0 +1 @@
+../codea/incremental.hpp
\ No newline at end of file
@@ -0,0 +1 @@
+../codea/interp.cpp
\ No newline at end of file
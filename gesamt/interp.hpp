@@ -0,0 +1 @@
+../codea/interp.hpp
\ No newline at end of file
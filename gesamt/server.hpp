@@ -0,0 +1 @@
+../codea/server.hpp
\ No newline at end of file